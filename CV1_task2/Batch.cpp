@@ -0,0 +1,363 @@
+#include "Batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "HarrisDetector.h"
+
+
+namespace
+{
+	/// <summary>
+	/// Rows at a band border that depend on the rows of the neighbouring band:
+	/// derivative (1) + Gaussian window radius (2) + NMS (1), plus one to spare.
+	/// </summary>
+	const int BandHalo = 5;
+
+	/// <summary>
+	/// Gets the lower case extension of the path without the dot.
+	/// </summary>
+	std::string extension(const std::string & Path)
+	{
+		const size_t Dot = Path.find_last_of('.');
+		const size_t Slash = Path.find_last_of("/\\");
+		std::string Ret;
+
+		if (Dot == std::string::npos || (Slash != std::string::npos && Dot < Slash)) {
+			return Ret;
+		}
+		for (size_t i = Dot + 1; i < Path.size(); ++i) {
+			Ret += (char)std::tolower((unsigned char)Path[i]);
+		}
+		return Ret;
+	}
+
+	bool isImage(const std::string & Path)
+	{
+		static const char * Extensions[] = { "png", "jpg", "jpeg", "bmp", "tif", "tiff", "pgm", "ppm", "pbm" };
+		const std::string Ext = extension(Path);
+
+		return std::find_if(std::begin(Extensions), std::end(Extensions), [&](const char * e) { return Ext == e; }) != std::end(Extensions);
+	}
+
+	/// <summary>
+	/// Strongest first, ties in scan order.
+	/// </summary>
+	bool isStronger(const cv::KeyPoint & a, const cv::KeyPoint & b)
+	{
+		if (a.response != b.response) {
+			return a.response > b.response;
+		}
+		if (a.pt.y != b.pt.y) {
+			return a.pt.y < b.pt.y;
+		}
+		return a.pt.x < b.pt.x;
+	}
+
+	void writeU32(std::ostream & Out, uint32_t Value)
+	{
+		const unsigned char Bytes[4] = {
+			(unsigned char)Value,
+			(unsigned char)(Value >> 8),
+			(unsigned char)(Value >> 16),
+			(unsigned char)(Value >> 24)
+		};
+		Out.write((const char *)Bytes, 4);
+	}
+
+	void writeF32(std::ostream & Out, float Value)
+	{
+		uint32_t u;
+		std::memcpy(&u, &Value, sizeof(u));
+		writeU32(Out, u);
+	}
+
+	/// <summary>
+	/// Detects the corners of one row band of the image.
+	/// Every band runs its own detector on the band plus BandHalo rows on each side
+	/// and keeps the corners of its own rows only.
+	/// </summary>
+	class BandBody : public cv::ParallelLoopBody
+	{
+	public:
+		BandBody(const cv::Mat & Img, int Bands, std::vector<std::vector<cv::KeyPoint>> & Corners)
+			: _Img(Img), _Bands(Bands), _Corners(Corners)
+		{
+		}
+
+		void operator()(const cv::Range & Range) const override
+		{
+			for (int b = Range.start; b < Range.end; ++b) {
+				const int
+					y0 = (int)((int64)_Img.rows * b / _Bands),
+					y1 = (int)((int64)_Img.rows * (b + 1) / _Bands),
+					lo = std::max(0, y0 - BandHalo),
+					hi = std::min(_Img.rows, y1 + BandHalo);
+				HarrisDetector Harris(_Img.rowRange(lo, hi));
+
+				for (cv::KeyPoint Corner : Harris.getStrongestCorners(std::numeric_limits<int>::max())) {
+					Corner.pt.y += lo;
+					if (y0 <= Corner.pt.y && Corner.pt.y < y1) {
+						_Corners[b].push_back(Corner);
+					}
+				}
+			}
+		}
+
+	private:
+		const cv::Mat & _Img;
+		int _Bands;
+		std::vector<std::vector<cv::KeyPoint>> & _Corners;
+	};
+}
+
+Batch::Batch()
+{
+}
+
+Batch::Batch(const Options & Opt)
+	: _Options(Opt)
+{
+}
+
+Batch::~Batch()
+{
+}
+
+/// <summary>
+/// Detects the corners of the image in one piece.
+/// </summary>
+/// <param name="Img">The img.</param>
+/// <returns>std::vector</returns>
+std::vector<cv::KeyPoint> Batch::_detect(const cv::Mat & Img) const
+{
+	HarrisDetector Harris(Img);
+	std::vector<cv::KeyPoint> Ret = Harris.getStrongestCorners(_Options.Top > 0 ? _Options.Top : std::numeric_limits<int>::max());
+
+	_select(Ret);
+	return Ret;
+}
+
+/// <summary>
+/// Detects the corners of the image band by band in parallel.
+/// </summary>
+/// <param name="Img">The img.</param>
+/// <returns>std::vector</returns>
+std::vector<cv::KeyPoint> Batch::_detectBands(const cv::Mat & Img) const
+{
+	const int Bands = std::max(1, std::min(cv::getNumThreads() * 4, Img.rows / (16 * BandHalo)));
+	std::vector<std::vector<cv::KeyPoint>> Corners(Bands);
+	std::vector<cv::KeyPoint> Ret;
+
+	cv::parallel_for_(cv::Range(0, Bands), BandBody(Img, Bands, Corners));
+
+	for (const std::vector<cv::KeyPoint> & Band : Corners) {
+		Ret.insert(Ret.end(), Band.begin(), Band.end());
+	}
+
+	_select(Ret);
+	return Ret;
+}
+
+/// <summary>
+/// Applies the threshold and the top K limit and sorts the corners, strongest first.
+/// </summary>
+/// <param name="Corners">The corners.</param>
+void Batch::_select(std::vector<cv::KeyPoint> & Corners) const
+{
+	const float Threshold = _Options.Threshold;
+
+	Corners.erase(
+		std::remove_if(Corners.begin(), Corners.end(), [Threshold](const cv::KeyPoint & Corner) { return !(Corner.response > Threshold); }),
+		Corners.end()
+	);
+
+	if (_Options.Top > 0 && (int)Corners.size() > _Options.Top) {
+		std::nth_element(Corners.begin(), Corners.begin() + (_Options.Top - 1), Corners.end(), isStronger);
+		Corners.resize(_Options.Top);
+	}
+
+	std::sort(Corners.begin(), Corners.end(), isStronger);
+}
+
+/// <summary>
+/// Adds the images of a directory, or of a list file with one path per line.
+/// Paths ending in .txt are list files, empty lines and lines starting with # are ignored.
+/// </summary>
+/// <param name="Path">The directory or the list file.</param>
+/// <returns>false if no image was found</returns>
+bool Batch::addInput(const std::string & Path)
+{
+	std::vector<std::string> Images;
+
+	if (extension(Path) == "txt") {
+		std::ifstream In(Path);
+		std::string Line;
+
+		while (std::getline(In, Line)) {
+			Line.erase(Line.find_last_not_of(" \t\r") + 1);
+			if (!Line.empty() && Line[0] != '#') {
+				Images.push_back(Line);
+			}
+		}
+	}
+	else {
+		std::vector<cv::String> Files;
+		cv::glob(Path, Files, false);
+
+		for (const cv::String & File : Files) {
+			if (isImage(File)) {
+				Images.push_back(File);
+			}
+		}
+	}
+
+	for (const std::string & Image : Images) {
+		Result R;
+		R.Image = Image;
+		_Results.push_back(R);
+	}
+
+	return !Images.empty();
+}
+
+/// <summary>
+/// Detects the corners of all images.
+/// Large images are read a second time after the pool has finished,
+/// so the pool never holds more than one image per thread.
+/// </summary>
+void Batch::run()
+{
+	const int Threads = _Options.Threads > 0 ? _Options.Threads : std::max(1, (int)std::thread::hardware_concurrency());
+	std::atomic<size_t> Next(0);
+	std::mutex Mutex;
+	std::vector<size_t> Large;
+
+	auto Worker = [&]() {
+		for (size_t i = Next++; i < _Results.size(); i = Next++) {
+			Result & R = _Results[i];
+			const cv::Mat Img = cv::imread(R.Image);
+
+			if (Img.empty()) {
+				continue;
+			}
+			R.Size = Img.size();
+
+			if ((int64)Img.total() >= _Options.LargeImage) {
+				std::lock_guard<std::mutex> Lock(Mutex);
+				Large.push_back(i);
+				continue;
+			}
+			R.Corners = _detect(Img);
+		}
+	};
+
+	std::vector<std::thread> Pool;
+	for (int t = 1; t < Threads; ++t) {
+		Pool.emplace_back(Worker);
+	}
+	Worker();
+	for (std::thread & t : Pool) {
+		t.join();
+	}
+
+	const int PrevThreads = cv::getNumThreads();
+	cv::setNumThreads(Threads);
+	std::sort(Large.begin(), Large.end());
+
+	for (size_t i : Large) {
+		const cv::Mat Img = cv::imread(_Results[i].Image);
+
+		if (!Img.empty()) {
+			_Results[i].Corners = _detectBands(Img);
+		}
+	}
+
+	cv::setNumThreads(PrevThreads);
+}
+
+const std::vector<Batch::Result> & Batch::getResults() const
+{
+	return _Results;
+}
+
+/// <summary>
+/// Writes the results as CSV if the path ends in .csv, else in the binary format.
+/// </summary>
+/// <param name="Path">The path.</param>
+/// <returns>false if the file could not be written</returns>
+bool Batch::write(const std::string & Path) const
+{
+	return extension(Path) == "csv" ? writeCsv(Path) : writeBinary(Path);
+}
+
+/// <summary>
+/// Writes the results as CSV: image,x,y,response
+/// </summary>
+/// <param name="Path">The path.</param>
+/// <returns>false if the file could not be written</returns>
+bool Batch::writeCsv(const std::string & Path) const
+{
+	std::ofstream Out(Path);
+	if (!Out) {
+		return false;
+	}
+
+	Out.precision(9);
+	Out << "image,x,y,response\n";
+
+	for (const Result & R : _Results) {
+		std::string Image = R.Image;
+
+		if (Image.find_first_of(",\"") != std::string::npos) {
+			for (size_t i = Image.find('"'); i != std::string::npos; i = Image.find('"', i + 2)) {
+				Image.insert(i, 1, '"');
+			}
+			Image = '"' + Image + '"';
+		}
+		for (const cv::KeyPoint & Corner : R.Corners) {
+			Out << Image << ',' << Corner.pt.x << ',' << Corner.pt.y << ',' << Corner.response << '\n';
+		}
+	}
+
+	return bool(Out);
+}
+
+/// <summary>
+/// Writes the results in the binary format, see <see cref="Batch"/>.
+/// </summary>
+/// <param name="Path">The path.</param>
+/// <returns>false if the file could not be written</returns>
+bool Batch::writeBinary(const std::string & Path) const
+{
+	std::ofstream Out(Path, std::ios::binary);
+	if (!Out) {
+		return false;
+	}
+
+	Out.write("HKP1", 4);
+	writeU32(Out, (uint32_t)_Results.size());
+
+	for (const Result & R : _Results) {
+		writeU32(Out, (uint32_t)R.Image.size());
+		Out.write(R.Image.data(), R.Image.size());
+		writeU32(Out, (uint32_t)R.Size.width);
+		writeU32(Out, (uint32_t)R.Size.height);
+		writeU32(Out, (uint32_t)R.Corners.size());
+
+		for (const cv::KeyPoint & Corner : R.Corners) {
+			writeF32(Out, Corner.pt.x);
+			writeF32(Out, Corner.pt.y);
+			writeF32(Out, Corner.response);
+		}
+	}
+
+	return bool(Out);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <limits>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+
+/// <summary>
+/// Headless corner detection over many images.
+/// The images are spread over a pool of worker threads, one image per task.
+/// Large images are kept back and run one after the other afterwards,
+/// each split into overlapping row bands that are detected in parallel.
+/// The bands overlap far enough that the corners are the same as in a single run.
+/// </summary>
+/// <remarks>
+/// Binary output, all values little endian:
+///   "HKP1", uint32 image count, then per image
+///   uint32 path length, path bytes, uint32 width, uint32 height, uint32 corner count,
+///   and per corner float x, float y, float response.
+/// CSV output: image,x,y,response with one line per corner.
+/// Images that could not be read have width, height and corner count 0.
+/// </remarks>
+class Batch
+{
+public:
+	struct Options
+	{
+		int Threads = 0; /// <value>worker threads, 0 for one per core</value>
+		int Top = 0; /// <value>keep the K strongest corners per image, 0 for all</value>
+		float Threshold = -std::numeric_limits<float>::infinity(); /// <value>keep corners with a higher response</value>
+		int LargeImage = 4 * 1024 * 1024; /// <value>pixels from which an image is split into bands</value>
+	};
+
+	struct Result
+	{
+		std::string Image;
+		cv::Size Size;
+		std::vector<cv::KeyPoint> Corners; /// <value>strongest first</value>
+	};
+
+private:
+	Options _Options;
+	std::vector<Result> _Results;
+
+private:
+	std::vector<cv::KeyPoint> _detect(const cv::Mat & Img) const;
+	std::vector<cv::KeyPoint> _detectBands(const cv::Mat & Img) const;
+	void _select(std::vector<cv::KeyPoint> & Corners) const;
+
+public:
+	Batch();
+	Batch(const Options & Opt);
+	~Batch();
+
+	bool addInput(const std::string & Path);
+	void run();
+	const std::vector<Result> & getResults() const;
+	bool write(const std::string & Path) const;
+	bool writeCsv(const std::string & Path) const;
+	bool writeBinary(const std::string & Path) const;
+};
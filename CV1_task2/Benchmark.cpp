@@ -0,0 +1,307 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "HarrisDetector.h"
+
+
+namespace
+{
+	/// <summary>
+	/// Forwards to the standard allocator and counts every buffer it hands out.
+	/// Headers of user data are not counted, only real allocations.
+	/// </summary>
+	class CountingAllocator : public cv::MatAllocator
+	{
+	public:
+		mutable std::atomic<size_t> Allocations;
+		mutable std::atomic<size_t> Bytes;
+
+		CountingAllocator() : Allocations(0), Bytes(0), _Std(cv::Mat::getStdAllocator()) {}
+
+		cv::UMatData * allocate(int dims, const int * sizes, int type, void * data, size_t * step, int flags, cv::UMatUsageFlags usageFlags) const override
+		{
+			cv::UMatData * u = _Std->allocate(dims, sizes, type, data, step, flags, usageFlags);
+			if (u && !data) {
+				++Allocations;
+				Bytes += u->size;
+			}
+			return u;
+		}
+
+		bool allocate(cv::UMatData * data, int accessFlags, cv::UMatUsageFlags usageFlags) const override
+		{
+			return _Std->allocate(data, accessFlags, usageFlags);
+		}
+
+		void deallocate(cv::UMatData * data) const override
+		{
+			_Std->deallocate(data);
+		}
+
+	private:
+		cv::MatAllocator * _Std;
+	};
+
+	/// <summary>
+	/// Installs the counting allocator as default allocator for its lifetime.
+	/// </summary>
+	class AllocatorScope
+	{
+	public:
+		AllocatorScope(cv::MatAllocator * Allocator) : _Prev(cv::Mat::getDefaultAllocator())
+		{
+			cv::Mat::setDefaultAllocator(Allocator);
+		}
+
+		~AllocatorScope()
+		{
+			cv::Mat::setDefaultAllocator(_Prev);
+		}
+
+	private:
+		cv::MatAllocator * _Prev;
+	};
+
+	CountingAllocator Counter;
+
+	/// <summary>
+	/// Times one call and counts its allocations.
+	/// Keeps the best time of all calls and the allocations of the last one.
+	/// </summary>
+	template<typename Functor>
+	void measure(Benchmark::Measurement & M, const Functor & Fnc)
+	{
+		const size_t
+			Allocations = Counter.Allocations,
+			Bytes = Counter.Bytes;
+		const int64 Start = cv::getTickCount();
+
+		Fnc();
+
+		const double Seconds = (cv::getTickCount() - Start) / cv::getTickFrequency();
+		M.Seconds = std::min(M.Seconds, Seconds);
+		M.Allocations = Counter.Allocations - Allocations;
+		M.Bytes = Counter.Bytes - Bytes;
+	}
+
+	/// <summary>
+	/// Writes the string as JSON string literal.
+	/// </summary>
+	void writeJsonString(std::ostream & Out, const std::string & Str)
+	{
+		Out << '"';
+		for (char ch : Str) {
+			switch (ch) {
+			case '"': Out << "\\\""; break;
+			case '\\': Out << "\\\\"; break;
+			case '\n': Out << "\\n"; break;
+			case '\t': Out << "\\t"; break;
+			default:
+				if (static_cast<unsigned char>(ch) < 0x20) {
+					// JSON allows no raw control characters inside a string
+					char Escape[8];
+					std::snprintf(Escape, sizeof(Escape), "\\u%04x", static_cast<unsigned char>(ch));
+					Out << Escape;
+				}
+				else {
+					Out << ch;
+				}
+			}
+		}
+		Out << '"';
+	}
+
+	void writeJsonMeasurement(std::ostream & Out, const Benchmark::Measurement & M, const cv::Size & Size)
+	{
+		Out << "{ \"name\": ";
+		writeJsonString(Out, M.Name);
+		Out << ", \"seconds\": " << M.Seconds
+			<< ", \"pixels_per_second\": " << (M.Seconds > 0.0 ? Size.area() / M.Seconds : 0.0)
+			<< ", \"allocations\": " << M.Allocations
+			<< ", \"bytes\": " << M.Bytes << " }";
+	}
+}
+
+Benchmark::Benchmark(int Repetitions)
+	: _Repetitions(std::max(1, Repetitions))
+	, _Scales({ 1, 2, 4 })
+{
+}
+
+Benchmark::~Benchmark()
+{
+}
+
+/// <summary>
+/// Benchmarks one image at one scale.
+/// Every repetition starts with a new detector, so every stage is computed exactly once per repetition.
+/// </summary>
+/// <param name="Name">The name of the image.</param>
+/// <param name="Img">The img at the given scale.</param>
+/// <param name="Scale">The scale.</param>
+/// <returns>Benchmark::Result</returns>
+Benchmark::Result Benchmark::_run(const std::string & Name, const cv::Mat & Img, int Scale)
+{
+	const char * StageNames[] = { "derivatives", "products", "blur", "response", "nms" };
+	Result Ret;
+
+	Ret.Image = Name;
+	Ret.Scale = Scale;
+	Ret.Size = Img.size();
+	Ret.Stages.resize(5);
+	for (int i = 0; i < 5; ++i) {
+		Ret.Stages[i].Name = StageNames[i];
+		Ret.Stages[i].Seconds = std::numeric_limits<double>::max();
+	}
+	Ret.Pipeline.Name = "pipeline";
+	Ret.Pipeline.Seconds = std::numeric_limits<double>::max();
+
+	for (int n = 0; n < _Repetitions; ++n) {
+		HarrisDetector Harris(Img);
+
+		measure(Ret.Stages[0], [&]() { Harris.getDerivatives(); });
+		measure(Ret.Stages[1], [&]() { Harris.getProducts(); });
+		measure(Ret.Stages[2], [&]() { Harris.getStructureTensor(); });
+		measure(Ret.Stages[3], [&]() { Harris.getResponse(); });
+		measure(Ret.Stages[4], [&]() { Harris.getCorners(); });
+
+		Ret.Corners = cv::countNonZero(Harris.getCorners());
+	}
+
+	for (int n = 0; n < _Repetitions; ++n) {
+		measure(Ret.Pipeline, [&]() {
+			HarrisDetector Harris(Img);
+			Harris.getCorners();
+		});
+	}
+
+	return Ret;
+}
+
+/// <summary>
+/// Benchmarks the image at every scale.
+/// </summary>
+/// <param name="Path">The path of the image.</param>
+/// <returns>false if the image could not be read</returns>
+bool Benchmark::run(const std::string & Path)
+{
+	const cv::Mat Img = cv::imread(Path);
+	if (Img.empty()) {
+		return false;
+	}
+
+	AllocatorScope Scope(&Counter);
+
+	for (int Scale : _Scales) {
+		cv::Mat Scaled = Img;
+		if (Scale != 1) {
+			cv::resize(Img, Scaled, cv::Size(), Scale, Scale, cv::INTER_LINEAR);
+		}
+		_Results.push_back(_run(Path, Scaled, Scale));
+	}
+
+	return true;
+}
+
+const std::vector<Benchmark::Result> & Benchmark::getResults() const
+{
+	return _Results;
+}
+
+/// <summary>
+/// Prints the results as table, one line per measurement.
+/// </summary>
+/// <param name="Out">The output stream.</param>
+void Benchmark::print(std::ostream & Out) const
+{
+	// the manipulators below must not leak into the caller's stream
+	const std::ios::fmtflags Flags = Out.flags();
+	const std::streamsize Precision = Out.precision();
+
+	Out << std::left << std::setw(20) << "image" << std::setw(7) << "scale" << std::setw(12) << "stage"
+		<< std::right << std::setw(12) << "ms" << std::setw(12) << "Mpx/s" << std::setw(8) << "allocs" << std::setw(12) << "MiB" << std::endl;
+
+	for (const Result & R : _Results) {
+		std::vector<Measurement> All(R.Stages);
+		All.push_back(R.Pipeline);
+
+		for (const Measurement & M : All) {
+			Out << std::left << std::setw(20) << R.Image << std::setw(7) << R.Scale << std::setw(12) << M.Name
+				<< std::right << std::fixed << std::setprecision(3)
+				<< std::setw(12) << M.Seconds * 1e3
+				<< std::setw(12) << (M.Seconds > 0.0 ? R.Size.area() / M.Seconds * 1e-6 : 0.0)
+				<< std::setw(8) << M.Allocations
+				<< std::setw(12) << M.Bytes / (1024.0 * 1024.0) << std::endl;
+		}
+	}
+
+	Out.flags(Flags);
+	Out.precision(Precision);
+}
+
+/// <summary>
+/// Writes the results as JSON.
+/// </summary>
+/// <param name="Path">The path of the JSON file.</param>
+/// <returns>false if the file could not be written</returns>
+bool Benchmark::writeJson(const std::string & Path) const
+{
+	std::ofstream Out(Path);
+	if (!Out) {
+		return false;
+	}
+
+	Out << std::setprecision(9);
+	Out << "{\n  \"repetitions\": " << _Repetitions
+		<< ",\n  \"threads\": " << cv::getNumThreads()
+		<< ",\n  \"results\": [";
+
+	for (size_t i = 0; i < _Results.size(); ++i) {
+		const Result & R = _Results[i];
+
+		Out << (i ? "," : "") << "\n    {\n      \"image\": ";
+		writeJsonString(Out, R.Image);
+		Out << ",\n      \"scale\": " << R.Scale
+			<< ",\n      \"width\": " << R.Size.width
+			<< ",\n      \"height\": " << R.Size.height
+			<< ",\n      \"pixels\": " << R.Size.area()
+			<< ",\n      \"corners\": " << R.Corners
+			<< ",\n      \"stages\": [";
+		for (size_t s = 0; s < R.Stages.size(); ++s) {
+			Out << (s ? "," : "") << "\n        ";
+			writeJsonMeasurement(Out, R.Stages[s], R.Size);
+		}
+		Out << "\n      ],\n      \"pipeline\": ";
+		writeJsonMeasurement(Out, R.Pipeline, R.Size);
+		Out << "\n    }";
+	}
+
+	Out << "\n  ]\n}\n";
+	return bool(Out);
+}
+
+/// <summary>
+/// Gets the test images that come with the project.
+/// </summary>
+/// <returns>std::vector</returns>
+std::vector<std::string> Benchmark::getDefaultImages()
+{
+	return {
+		"checkerboard.png",
+		"checkerboard2.png",
+		"lines.png",
+		"rhombus.png",
+		"ufo2.jpg",
+		"ufo2noi2.jpg",
+		"wdg2.jpg",
+		"baum.jpg"
+	};
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+
+/// <summary>
+/// Micro and macro benchmark of the HarrisDetector.
+/// Every stage (derivatives, tensor products, blur, response, NMS) is timed on its own
+/// and the whole pipeline from the image to the corners is timed in one go,
+/// on every image at 1x, 2x and 4x its size.
+/// The time of a measurement is the best of all repetitions.
+/// Allocations are counted by a cv::MatAllocator that is the default allocator while the benchmark runs.
+/// </summary>
+class Benchmark
+{
+public:
+	struct Measurement
+	{
+		std::string Name;
+		double Seconds = 0.0;
+		size_t Allocations = 0; /// <value>number of cv::Mat allocations</value>
+		size_t Bytes = 0; /// <value>bytes allocated by cv::Mat</value>
+	};
+
+	struct Result
+	{
+		std::string Image;
+		int Scale = 1;
+		cv::Size Size;
+		int Corners = 0; /// <value>local maxima after NMS</value>
+		std::vector<Measurement> Stages;
+		Measurement Pipeline;
+	};
+
+private:
+	int _Repetitions;
+	std::vector<int> _Scales;
+	std::vector<Result> _Results;
+
+private:
+	Result _run(const std::string & Name, const cv::Mat & Img, int Scale);
+
+public:
+	Benchmark(int Repetitions = 5);
+	~Benchmark();
+
+	bool run(const std::string & Path);
+	const std::vector<Result> & getResults() const;
+	void print(std::ostream & Out) const;
+	bool writeJson(const std::string & Path) const;
+
+	static std::vector<std::string> getDefaultImages();
+};
@@ -1,8 +1,27 @@
 #include "HarrisDetector.h"
+#include "Kernels.h"
 #include "Utils.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
 #include <opencv2/imgproc/imgproc.hpp>
 
+namespace
+{
+	/// <summary>
+	/// Maps the float to an unsigned integer with the same order.
+	/// Positive floats get the sign bit set, negative ones are inverted.
+	/// </summary>
+	inline uint32_t orderedBits(float Value)
+	{
+		uint32_t u;
+		std::memcpy(&u, &Value, sizeof(u));
+		return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+	}
+}
+
 /// <summary>
 /// Initializes a new instance of the <see cref="HarrisDetector"/> class.
 /// </summary>
@@ -12,7 +31,7 @@ HarrisDetector::HarrisDetector()
 
 /// <summary>
 /// Initializes a new instance of the <see cref="HarrisDetector"/> class.
-/// Calculates the Harris corner response.
+/// Prepares the Harris corner response of the image.
 /// </summary>
 /// <remarks>
 /// A Combined Corner And Edge Detector - Harris & Stephens
@@ -36,23 +55,20 @@ HarrisDetector::HarrisDetector()
 /// The flat region is specified by Tr falling below some selected threshold
 /// Corner region pixel is an 8-way local maximum
 /// Edge region pixel if R negative and local minimum
+///
+/// The stages are computed on first demand and cached:
+/// derivatives -> structure tensor -> response -> corners (non-maxima suppression).
+/// The image is referenced, not copied, it must not change while the detector is in use.
 /// </remarks>
 /// <param name="Img">The img.</param>
-HarrisDetector::HarrisDetector(const cv::Mat & Img)
-	: _ImgOrig(Img.clone())
+/// <param name="Integration">The weighting window w.</param>
+/// <param name="Radius">The radius r of the box window, ignored for the gaussian one.</param>
+HarrisDetector::HarrisDetector(const cv::Mat & Img, Window Integration, int Radius)
+	: _ImgOrig(Img),
+	_Window(Integration),
+	_Radius(Radius)
 {
-	cv::Mat WorkingCopy;
-	std::array<cv::Mat, 3> StructureTensor;
-	_ImgOrig.convertTo(WorkingCopy, CV_32F);
-	WorkingCopy = Utils::convertImgToGray(WorkingCopy);
-
-	_Derivatives = _computeDerivatives(WorkingCopy);
-
-	StructureTensor[0] = _convolveGaussian(_Derivatives[0].mul(_Derivatives[0])); // A = X^2 * w
-	StructureTensor[1] = _convolveGaussian(_Derivatives[1].mul(_Derivatives[1])); // B = Y^2 * w
-	StructureTensor[2] = _convolveGaussian(_Derivatives[0].mul(_Derivatives[1])); // C = (XY) * w
-
-	_Response = _computeResponse(StructureTensor);
+	CV_Assert(Radius >= 0);
 }
 
 /// <summary>
@@ -63,53 +79,166 @@ HarrisDetector::~HarrisDetector()
 }
 
 /// <summary>
-/// Convolves the image with the kernel.
+/// Convolves the image with a gaussian kernel.
+/// </summary>
+/// <remarks>
+/// Separable binomial kernel (1, 4, 6, 4, 1) / 16 along both axes,
+/// its variance is 1, so it's the discrete Gaussian for sigma = 1.
+/// </remarks>
+/// <param name="Img">The img.</param>
+/// <returns>cv::Mat</returns>
+cv::Mat HarrisDetector::_convolveGaussian(const cv::Mat & Img)
+{
+	return Kernels::convolveSeparable<Kernels::Gaussian5, Kernels::Gaussian5>(Img);
+}
+
+/// <summary>
+/// Convolves the image with a normalized (2r + 1)x(2r + 1) box kernel.
 /// </summary>
+/// <remarks>
+/// Same scheme as mean_filter in CV1_task3: running sums along the rows and the columns,
+/// so the cost per pixel doesn't depend on the radius.
+/// Near the borders the window is clipped and the mean is taken over the pixels inside.
+/// The columns are summed row by row, which keeps the memory access sequential.
+/// </remarks>
 /// <param name="Img">The img.</param>
-/// <param name="Kernel">The kernel.</param>
+/// <param name="Radius">The radius r.</param>
 /// <returns>cv::Mat</returns>
-cv::Mat HarrisDetector::_convolveKernel(const cv::Mat & Img, const cv::Mat & Kernel)
+cv::Mat HarrisDetector::_convolveBox(const cv::Mat & Img, int Radius)
 {
-	cv::Mat Ret(Img.size(), CV_32F, cv::Scalar(0.0));
+	CV_Assert(Img.type() == CV_32FC1);
 
-	cv::filter2D(Img, Ret, CV_32F, Kernel);
+	const int
+		h = Img.rows,
+		w = Img.cols;
+	cv::Mat
+		Ret(Img.size(), CV_32F),
+		Horizontal(Img.size(), CV_32F);
+	std::vector<double>
+		Prefix(w + 1, 0.0), // prefix sums of the current row
+		Column(w, 0.0); // sums over the rows of the window
+
+	// horizontal
+	for (int r = 0; r < h; ++r) {
+		const float * src = Img.ptr<float>(r);
+		float * dst = Horizontal.ptr<float>(r);
+
+		for (int c = 0; c < w; ++c) {
+			Prefix[c + 1] = Prefix[c] + src[c];
+		}
+		for (int c = 0; c < w; ++c) {
+			const int
+				first = std::max(0, c - Radius),
+				last = std::min(w - 1, c + Radius);
+			dst[c] = (float)((Prefix[last + 1] - Prefix[first]) / (last - first + 1));
+		}
+	}
+
+	// vertical
+	for (int r = 0; r <= std::min(h - 1, Radius); ++r) {
+		const float * src = Horizontal.ptr<float>(r);
+		for (int c = 0; c < w; ++c) {
+			Column[c] += src[c];
+		}
+	}
+	for (int r = 0; r < h; ++r) {
+		const int
+			first = std::max(0, r - Radius),
+			last = std::min(h - 1, r + Radius);
+		const double norm = 1.0 / (last - first + 1);
+		float * dst = Ret.ptr<float>(r);
+
+		for (int c = 0; c < w; ++c) {
+			dst[c] = (float)(Column[c] * norm);
+		}
+
+		// slide the window one row down
+		if (r + Radius + 1 < h) {
+			const float * src = Horizontal.ptr<float>(r + Radius + 1);
+			for (int c = 0; c < w; ++c) {
+				Column[c] += src[c];
+			}
+		}
+		if (r - Radius >= 0) {
+			const float * src = Horizontal.ptr<float>(r - Radius);
+			for (int c = 0; c < w; ++c) {
+				Column[c] -= src[c];
+			}
+		}
+	}
 
 	return Ret;
 }
 
 /// <summary>
-/// Convolves the image with a gaussian kernel.
+/// Convolves the image with the selected weighting window.
 /// </summary>
-/// <remarks>
-/// Kernel from here: http://homepages.inf.ed.ac.uk/rbf/HIPR2/gsmooth.htm
-/// for sigma = 1
-/// </remarks>
 /// <param name="Img">The img.</param>
 /// <returns>cv::Mat</returns>
-cv::Mat HarrisDetector::_convolveGaussian(const cv::Mat & Img)
+cv::Mat HarrisDetector::_convolveWindow(const cv::Mat & Img)
 {
-	cv::Mat GaussianKernel = (cv::Mat_<float>(5, 5) <<
-		1, 4, 7, 4, 1,
-		4, 16, 26, 16, 4,
-		7, 16, 41, 16, 7,
-		4, 16, 26, 16, 4,
-		1, 4, 7, 4, 1);
-	GaussianKernel = GaussianKernel / 273.0;
-
-	return _convolveKernel(Img, GaussianKernel);
+	if (_Window == Window::Box) {
+		return _convolveBox(Img, _Radius);
+	}
+
+	return _convolveGaussian(Img);
 }
 
 /// <summary>
-/// Computes the derivatives.
+/// Computes the derivatives of the gray image.
+/// 8-bit gray and BGR images are converted and differentiated in a single pass,
+/// everything else is converted to a float gray image first.
 /// </summary>
 /// <param name="Img">The img.</param>
 /// <returns>std::array</returns>
 std::array<cv::Mat, 2> HarrisDetector::_computeDerivatives(const cv::Mat & Img)
 {
+	if (Img.depth() == CV_8U && (Img.channels() == 1 || Img.channels() == 3)) {
+		return Kernels::convolveLuma<Kernels::CentralDifference>(Img); // X = I * (-1, 0, 1), Y = I * (-1, 0, 1)T
+	}
+
 	std::array<cv::Mat, 2> Ret;
+	cv::Mat Gray;
+	Img.convertTo(Gray, CV_32F);
+	if (Gray.channels() == 3) {
+		Gray = Utils::convertImgToGray(Gray);
+	}
+
+	Ret[0] = Kernels::convolveRows<Kernels::CentralDifference>(Gray); // X = I * (-1, 0, 1)
+	Ret[1] = Kernels::convolveCols<Kernels::CentralDifference>(Gray); // Y = I * (-1, 0, 1)T
+
+	return Ret;
+}
+
+/// <summary>
+/// Computes the derivative products X^2, Y^2 and XY.
+/// </summary>
+/// <param name="Derivatives">The derivatives.</param>
+/// <returns>std::array</returns>
+std::array<cv::Mat, 3> HarrisDetector::_computeProducts(const std::array<cv::Mat, 2> & Derivatives)
+{
+	std::array<cv::Mat, 3> Ret;
+
+	Ret[0] = Derivatives[0].mul(Derivatives[0]); // X^2
+	Ret[1] = Derivatives[1].mul(Derivatives[1]); // Y^2
+	Ret[2] = Derivatives[0].mul(Derivatives[1]); // XY
+
+	return Ret;
+}
+
+/// <summary>
+/// Computes the structure tensor elements A, B and C
+/// by weighting the derivative products with the window.
+/// </summary>
+/// <param name="Products">The derivative products.</param>
+/// <returns>std::array</returns>
+std::array<cv::Mat, 3> HarrisDetector::_computeStructureTensor(const std::array<cv::Mat, 3> & Products)
+{
+	std::array<cv::Mat, 3> Ret;
 
-	Ret[0] = _convolveKernel(Img, (cv::Mat_<float>(1, 3) << -1, 0, 1)); // X = I * (-1, 0, 1)
-	Ret[1] = _convolveKernel(Img, (cv::Mat_<float>(3, 1) << -1, 0, 1)); // Y = I * (-1, 0, 1)T
+	Ret[0] = _convolveWindow(Products[0]); // A = X^2 * w
+	Ret[1] = _convolveWindow(Products[1]); // B = Y^2 * w
+	Ret[2] = _convolveWindow(Products[2]); // C = (XY) * w
 
 	return Ret;
 }
@@ -150,13 +279,17 @@ cv::Mat HarrisDetector::_computeResponse(const std::array<cv::Mat, 3>& Structure
 
 /// <summary>
 /// Performs the non-maxima suppression on a 3x3 neighboorhood.
+/// Every survivor is also appended to Maxima and counted in its response bin of Histogram,
+/// so the strongest corners can be selected without another pass over the image.
 /// </summary>
 /// <remarks>
 /// https://www.academia.edu/5524439/Non-maximum_Suppression_Using_fewer_than_Two_Comparisons_per_Pixel
 /// </remarks>
 /// <param name="Response">The response.</param>
+/// <param name="Maxima">The survivors.</param>
+/// <param name="Histogram">The survivors per response bin.</param>
 /// <returns>cv::Mat</returns>
-cv::Mat HarrisDetector::_nonMaximaSuppression(const cv::Mat & Response)
+cv::Mat HarrisDetector::_nonMaximaSuppression(const cv::Mat & Response, std::vector<cv::KeyPoint> & Maxima, std::vector<int> & Histogram)
 {
 	cv::Mat Ret(Response.size(), CV_32F, cv::Scalar(0.0)); // == Mask
 	int
@@ -168,6 +301,11 @@ cv::Mat HarrisDetector::_nonMaximaSuppression(const cv::Mat & Response)
 		next = 1;
 
 	bool(*skip)[2] = new bool[Response.cols][2]; // skanline mask
+	const float Size = _Window == Window::Box ? 2.f * _Radius + 1.f : 5.f; // diameter of the window
+
+	Maxima.clear();
+	Histogram.assign(1 << _HistogramBits, 0);
+
 	for (int i = 0; i < Response.cols; ++i) { // initialize mask
 		skip[i][0] = false;
 		skip[i][1] = false;
@@ -216,6 +354,8 @@ cv::Mat HarrisDetector::_nonMaximaSuppression(const cv::Mat & Response)
 			if (Response.at<float>(r, c) <= Response.at<float>(r - 1, c + 1)) { ++c; continue; }
 
 			Ret.at<float>(r, c) = Response.at<float>(r, c);
+			Maxima.push_back(cv::KeyPoint(cv::Point2f((float)c, (float)r), Size, -1.f, Response.at<float>(r, c)));
+			++Histogram[orderedBits(Response.at<float>(r, c)) >> (32 - _HistogramBits)];
 			++c;
 		}
 
@@ -246,31 +386,136 @@ cv::Mat HarrisDetector::_nonMaximaSuppression(const cv::Mat & Response, uchar Ne
 }
 
 /// <summary>
-/// Gets the Harris response.
+/// Gets the derivatives X and Y of the gray image.
+/// The returned matrices share their data with the detector, don't modify them.
 /// </summary>
-/// <returns>cv::Mat</returns>
-cv::Mat HarrisDetector::getResponse()
+/// <returns>std::array</returns>
+const std::array<cv::Mat, 2> & HarrisDetector::getDerivatives()
 {
-	cv::Mat Ret = _Response.clone();
+	if (_Derivatives[0].empty()) {
+		_Derivatives = _computeDerivatives(_ImgOrig);
+	}
+
+	return _Derivatives;
+}
+
+/// <summary>
+/// Gets copies of the derivatives converted to the given type, e.g. for display.
+/// </summary>
+/// <param name="Type">The type, only its depth is used.</param>
+/// <returns>std::array</returns>
+std::array<cv::Mat, 2> HarrisDetector::getDerivativesAs(int Type)
+{
+	const std::array<cv::Mat, 2> & Derivatives = getDerivatives();
+	std::array<cv::Mat, 2> Ret;
+
+	Derivatives[0].convertTo(Ret[0], Type);
+	Derivatives[1].convertTo(Ret[1], Type);
+
 	return Ret;
 }
 
 /// <summary>
-/// Gets the derivatives.
+/// Gets the derivative products X^2, Y^2 and XY before the weighting.
+/// The returned matrices share their data with the detector, don't modify them.
 /// </summary>
-/// <param name="raw">if set to <c>true</c> [raw].</param>
 /// <returns>std::array</returns>
-std::array<cv::Mat, 2> HarrisDetector::getDerivatives(bool raw)
+const std::array<cv::Mat, 3> & HarrisDetector::getProducts()
+{
+	if (_Products[0].empty()) {
+		_Products = _computeProducts(getDerivatives());
+	}
+
+	return _Products;
+}
+
+/// <summary>
+/// Gets the structure tensor elements A, B and C.
+/// The returned matrices share their data with the detector, don't modify them.
+/// </summary>
+/// <returns>std::array</returns>
+const std::array<cv::Mat, 3> & HarrisDetector::getStructureTensor()
+{
+	if (_StructureTensor[0].empty()) {
+		_StructureTensor = _computeStructureTensor(getProducts());
+	}
+
+	return _StructureTensor;
+}
+
+/// <summary>
+/// Gets the Harris response.
+/// The returned matrix shares its data with the detector, don't modify it.
+/// </summary>
+/// <returns>cv::Mat</returns>
+const cv::Mat & HarrisDetector::getResponse()
+{
+	if (_Response.empty()) {
+		_Response = _computeResponse(getStructureTensor());
+	}
+
+	return _Response;
+}
+
+/// <summary>
+/// Gets the Harris response after non-maxima suppression.
+/// Everything but the local maxima is 0.
+/// The returned matrix shares its data with the detector, don't modify it.
+/// </summary>
+/// <returns>cv::Mat</returns>
+const cv::Mat & HarrisDetector::getCorners()
+{
+	if (_Corners.empty()) {
+		_Corners = _nonMaximaSuppression(getResponse(), _Maxima, _Histogram);
+	}
+
+	return _Corners;
+}
+
+/// <summary>
+/// Gets the K strongest corners after non-maxima suppression, or all of them if there are fewer.
+/// The histogram of the NMS pass gives the bin that holds the K-th strongest response.
+/// Survivors above that bin are taken as they are, only the ones inside it are partially sorted.
+/// The corners are returned in scan order, with the cutoff bin's survivors last.
+/// </summary>
+/// <param name="K">The number of corners.</param>
+/// <returns>std::vector</returns>
+std::vector<cv::KeyPoint> HarrisDetector::getStrongestCorners(int K)
 {
-	std::array<cv::Mat, 2> Ret = {
-		_Derivatives[0].clone(),
-		_Derivatives[1].clone()
-	};
-
-	if (!raw) {
-		Ret[0].convertTo(Ret[0], _ImgOrig.type());
-		Ret[1].convertTo(Ret[1], _ImgOrig.type());
+	getCorners();
+
+	std::vector<cv::KeyPoint> Ret, Cutoff;
+	const int Shift = 32 - _HistogramBits;
+	int Bin = (int)_Histogram.size() - 1,
+		Above = 0; // survivors in the bins above Bin
+
+	if (K <= 0) {
+		return Ret;
 	}
+	if (K >= (int)_Maxima.size()) {
+		return _Maxima;
+	}
+
+	while (Above + _Histogram[Bin] < K) {
+		Above += _Histogram[Bin--];
+	}
+
+	Ret.reserve(K);
+	Cutoff.reserve(_Histogram[Bin]);
+	for (const cv::KeyPoint & Corner : _Maxima) {
+		const int b = (int)(orderedBits(Corner.response) >> Shift);
+
+		if (b > Bin) {
+			Ret.push_back(Corner);
+		}
+		else if (b == Bin) {
+			Cutoff.push_back(Corner);
+		}
+	}
+
+	std::nth_element(Cutoff.begin(), Cutoff.begin() + (K - Above - 1), Cutoff.end(),
+		[](const cv::KeyPoint & a, const cv::KeyPoint & b) { return a.response > b.response; });
+	Ret.insert(Ret.end(), Cutoff.begin(), Cutoff.begin() + (K - Above));
 
 	return Ret;
 }
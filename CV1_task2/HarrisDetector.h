@@ -1,31 +1,57 @@
 #pragma once
 
 #include <array>
+#include <vector>
 #include <opencv2/core/core.hpp>
 
 
 class HarrisDetector
 {
+public:
+  /// <summary>
+  /// Weighting window w of the structure tensor.
+  /// Gaussian: sigma = 1 (5x5).
+  /// Box: (2r + 1)x(2r + 1) mean from running sums, constant cost per pixel for any r.
+  /// </summary>
+  enum class Window { Gaussian, Box };
+
 private:
   cv::Mat _ImgOrig;
-  cv::Mat _Response;
+  Window _Window = Window::Gaussian;
+  int _Radius = 2;
   std::array<cv::Mat, 2> _Derivatives;
+  std::array<cv::Mat, 3> _Products;
+  std::array<cv::Mat, 3> _StructureTensor;
+  cv::Mat _Response;
+  cv::Mat _Corners;
+  std::vector<cv::KeyPoint> _Maxima; /// <value>NMS survivors in scan order</value>
+  std::vector<int> _Histogram; /// <value>NMS survivors per response bin: the top _HistogramBits of orderedBits(response)</value>
+
+  static const int _HistogramBits = 12;
 
 private:
-  cv::Mat _convolveKernel(const cv::Mat & Img, const cv::Mat & Kernel);
   cv::Mat _convolveGaussian(const cv::Mat & Img);
+  cv::Mat _convolveBox(const cv::Mat & Img, int Radius);
+  cv::Mat _convolveWindow(const cv::Mat & Img);
   std::array<cv::Mat, 2> _computeDerivatives(const cv::Mat & Img);
+  std::array<cv::Mat, 3> _computeProducts(const std::array<cv::Mat, 2> & Derivatives);
+  std::array<cv::Mat, 3> _computeStructureTensor(const std::array<cv::Mat, 3> & Products);
   cv::Mat _computeResponse(const std::array<cv::Mat, 3> & StructureTensor);
-  cv::Mat _nonMaximaSuppression(const cv::Mat & Response);
+  cv::Mat _nonMaximaSuppression(const cv::Mat & Response, std::vector<cv::KeyPoint> & Maxima, std::vector<int> & Histogram);
   cv::Mat _nonMaximaSuppression(const cv::Mat & Response, uchar Neighborhood);
 
 public:
   HarrisDetector();
-  HarrisDetector(const cv::Mat & Img);
+  HarrisDetector(const cv::Mat & Img, Window Integration = Window::Gaussian, int Radius = 2);
   ~HarrisDetector();
 
-  cv::Mat getResponse();
-  std::array<cv::Mat, 2> getDerivatives(bool raw = false);
+  const std::array<cv::Mat, 2> & getDerivatives();
+  std::array<cv::Mat, 2> getDerivativesAs(int Type);
+  const std::array<cv::Mat, 3> & getProducts();
+  const std::array<cv::Mat, 3> & getStructureTensor();
+  const cv::Mat & getResponse();
+  const cv::Mat & getCorners();
+  std::vector<cv::KeyPoint> getStrongestCorners(int K);
 
   /// <summary>
   /// Filters the img by responses.
@@ -38,12 +64,13 @@ public:
   template<typename Functor> inline
     cv::Mat filterImgByResponse(const Functor& cmpFnc)
   {
-    cv::Mat Ret = _ImgOrig.clone();
-    Ret.convertTo(Ret, CV_32F);
+    const cv::Mat & Response = getResponse();
+    cv::Mat Ret;
+    _ImgOrig.convertTo(Ret, CV_32F);
 
     for (int r = 0; r < Ret.rows; r++) {
       for (int c = 0; c < Ret.cols; c++) {
-        if (!cmpFnc(_Response.at<float>(r, c))) {
+        if (!cmpFnc(Response.at<float>(r, c))) {
           Ret.at<cv::Vec3f>(r, c) = cv::Vec3f(0, 0, 0);
         }
         //if (cmpFnc(_Response.at<float>(r, c))) {
@@ -67,8 +94,8 @@ public:
   template<typename Functor> inline
     cv::Mat filterCorners(const Functor& cmpFnc)
   {
-    cv::Mat Ret(_Response.size(), CV_32FC3, cv::Scalar::all(0.0));
-    cv::Mat NMS = _nonMaximaSuppression(_Response);
+    const cv::Mat & NMS = getCorners();
+    cv::Mat Ret(NMS.size(), CV_32FC3, cv::Scalar::all(0.0));
 
     for (int r = 0; r < Ret.rows; r++) {
       for (int c = 0; c < Ret.cols; c++) {
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <opencv2/core/core.hpp>
+
+/// <summary>
+/// Convolution kernels with their taps fixed at compile time.
+/// Every kernel is its own type, so each one gets a fully unrolled inner loop,
+/// zero taps are dropped and unit taps need no multiplication.
+/// The convolution functions correlate like cv::filter2D and use the same
+/// default border (BORDER_REFLECT_101), so they can replace it one to one.
+/// </summary>
+namespace Kernels
+{
+	/// <summary>
+	/// Binomial coefficient (n over k), evaluated at compile time.
+	/// </summary>
+	constexpr int binomial(int n, int k)
+	{
+		return (k == 0 || k == n) ? 1 : binomial(n - 1, k - 1) + binomial(n - 1, k);
+	}
+
+	/// <summary>
+	/// Sum of the taps.
+	/// </summary>
+	template<int... Taps> struct TapSum;
+
+	template<> struct TapSum<>
+	{
+		static constexpr int value = 0;
+	};
+
+	template<int Tap, int... Rest> struct TapSum<Tap, Rest...>
+	{
+		static constexpr int value = Tap + TapSum<Rest...>::value;
+	};
+
+	/// <summary>
+	/// One tap times one sample. Unit taps are resolved at compile time.
+	/// </summary>
+	template<int Tap> struct Term
+	{
+		static inline float apply(float v) { return Tap * v; }
+	};
+
+	template<> struct Term<1>
+	{
+		static inline float apply(float v) { return v; }
+	};
+
+	template<> struct Term<-1>
+	{
+		static inline float apply(float v) { return -v; }
+	};
+
+	/// <summary>
+	/// Unrolled dot product of the taps with the samples.
+	/// apply() reads samples Stride elements apart, gather() reads column x of consecutive rows.
+	/// </summary>
+	template<int... Taps> struct Dot;
+
+	template<int Tap> struct Dot<Tap>
+	{
+		static inline float apply(const float * p, int) { return Term<Tap>::apply(*p); }
+		static inline float gather(const float * const * Rows, int x) { return Term<Tap>::apply(Rows[0][x]); }
+	};
+
+	template<> struct Dot<0>
+	{
+		static inline float apply(const float *, int) { return 0.f; }
+		static inline float gather(const float * const *, int) { return 0.f; }
+	};
+
+	template<int Tap, int... Rest> struct Dot<Tap, Rest...>
+	{
+		static inline float apply(const float * p, int Stride)
+		{
+			return Term<Tap>::apply(*p) + Dot<Rest...>::apply(p + Stride, Stride);
+		}
+
+		static inline float gather(const float * const * Rows, int x)
+		{
+			return Term<Tap>::apply(Rows[0][x]) + Dot<Rest...>::gather(Rows + 1, x);
+		}
+	};
+
+	template<int... Rest> struct Dot<0, Rest...>
+	{
+		static inline float apply(const float * p, int Stride) { return Dot<Rest...>::apply(p + Stride, Stride); }
+		static inline float gather(const float * const * Rows, int x) { return Dot<Rest...>::gather(Rows + 1, x); }
+	};
+
+	/// <summary>
+	/// A 1D kernel of odd length, anchored in the middle.
+	/// Kernels with a non zero tap sum are normalized by it.
+	/// </summary>
+	template<int... Taps> struct Kernel1D
+	{
+		static constexpr int size = sizeof...(Taps);
+		static constexpr int radius = size / 2;
+		static constexpr int sum = TapSum<Taps...>::value;
+		static constexpr float scale = sum == 0 ? 1.f : 1.f / sum;
+
+		static_assert(size % 2 == 1, "Kernel1D needs an odd number of taps");
+
+		static inline float apply(const float * p, int Stride) { return scale * Dot<Taps...>::apply(p, Stride); }
+		static inline float gather(const float * const * Rows, int x) { return scale * Dot<Taps...>::gather(Rows, x); }
+	};
+
+	template<int... I> struct Indices {};
+	template<int N, int... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+	template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+	template<int N, typename Seq = typename MakeIndices<N + 1>::type> struct BinomialKernel;
+	template<int N, int... I> struct BinomialKernel<N, Indices<I...>>
+	{
+		typedef Kernel1D<binomial(N, I)...> type;
+	};
+
+	/// <summary>
+	/// Binomial kernel of order N (N + 1 taps), the discrete Gaussian with variance N / 4.
+	/// </summary>
+	template<int N> using Binomial = typename BinomialKernel<N>::type;
+
+	/// <summary>
+	/// (-1, 0, 1)
+	/// </summary>
+	typedef Kernel1D<-1, 0, 1> CentralDifference;
+
+	/// <summary>
+	/// (1, 4, 6, 4, 1) / 16 -> Gaussian with sigma = 1
+	/// </summary>
+	typedef Binomial<4> Gaussian5;
+
+	/// <summary>
+	/// Convolves one row of floats with the kernel.
+	/// </summary>
+	/// <param name="Src">The source row.</param>
+	/// <param name="Dst">The destination row.</param>
+	/// <param name="Cols">The number of columns.</param>
+	template<typename Kernel>
+	inline void convolveRow(const float * Src, float * Dst, int Cols)
+	{
+		const int
+			r = Kernel::radius,
+			lo = std::min(r, Cols), // first column with all taps inside the row
+			hi = std::max(lo, Cols - r); // first column with taps right of the row
+		float Border[Kernel::size];
+		int x = 0;
+
+		for (; x < lo; ++x) {
+			for (int i = 0; i < Kernel::size; ++i) {
+				Border[i] = Src[cv::borderInterpolate(x - r + i, Cols, cv::BORDER_REFLECT_101)];
+			}
+			Dst[x] = Kernel::apply(Border, 1);
+		}
+		for (; x < hi; ++x) {
+			Dst[x] = Kernel::apply(Src + x - r, 1);
+		}
+		for (; x < Cols; ++x) {
+			for (int i = 0; i < Kernel::size; ++i) {
+				Border[i] = Src[cv::borderInterpolate(x - r + i, Cols, cv::BORDER_REFLECT_101)];
+			}
+			Dst[x] = Kernel::apply(Border, 1);
+		}
+	}
+
+	/// <summary>
+	/// Convolves every row of the single channel float image with the kernel.
+	/// </summary>
+	/// <param name="Img">The img.</param>
+	/// <returns>cv::Mat</returns>
+	template<typename Kernel>
+	cv::Mat convolveRows(const cv::Mat & Img)
+	{
+		CV_Assert(Img.type() == CV_32FC1);
+
+		cv::Mat Ret(Img.size(), CV_32F);
+
+		for (int y = 0; y < Img.rows; ++y) {
+			convolveRow<Kernel>(Img.ptr<float>(y), Ret.ptr<float>(y), Img.cols);
+		}
+
+		return Ret;
+	}
+
+	/// <summary>
+	/// Convolves every column of the single channel float image with the kernel.
+	/// </summary>
+	/// <param name="Img">The img.</param>
+	/// <returns>cv::Mat</returns>
+	template<typename Kernel>
+	cv::Mat convolveCols(const cv::Mat & Img)
+	{
+		CV_Assert(Img.type() == CV_32FC1);
+
+		const int r = Kernel::radius;
+		cv::Mat Ret(Img.size(), CV_32F);
+		const float * Rows[Kernel::size];
+
+		for (int y = 0; y < Img.rows; ++y) {
+			float * dst = Ret.ptr<float>(y);
+
+			for (int i = 0; i < Kernel::size; ++i) {
+				Rows[i] = Img.ptr<float>(cv::borderInterpolate(y - r + i, Img.rows, cv::BORDER_REFLECT_101));
+			}
+			for (int x = 0; x < Img.cols; ++x) {
+				dst[x] = Kernel::gather(Rows, x);
+			}
+		}
+
+		return Ret;
+	}
+
+	/// <summary>
+	/// Convolves the single channel float image with KernelX along the rows
+	/// and with KernelY along the columns.
+	/// </summary>
+	/// <param name="Img">The img.</param>
+	/// <returns>cv::Mat</returns>
+	template<typename KernelX, typename KernelY>
+	cv::Mat convolveSeparable(const cv::Mat & Img)
+	{
+		return convolveCols<KernelY>(convolveRows<KernelX>(Img));
+	}
+
+	/// <summary>
+	/// Luma weights of cv::COLOR_BGR2GRAY.
+	/// </summary>
+	constexpr float LumaB = 0.114f, LumaG = 0.587f, LumaR = 0.299f;
+
+	/// <summary>
+	/// Converts one 8-bit gray or BGR row to float luma.
+	/// </summary>
+	/// <param name="Src">The source row.</param>
+	/// <param name="Dst">The destination row.</param>
+	/// <param name="Cols">The number of columns.</param>
+	/// <param name="Channels">The number of channels, 1 or 3.</param>
+	inline void lumaRow(const uchar * Src, float * Dst, int Cols, int Channels)
+	{
+		if (Channels == 1) {
+			for (int x = 0; x < Cols; ++x) {
+				Dst[x] = Src[x];
+			}
+			return;
+		}
+
+		for (int x = 0; x < Cols; ++x, Src += 3) {
+			Dst[x] = Src[0] * LumaB + Src[1] * LumaG + Src[2] * LumaR;
+		}
+	}
+
+	/// <summary>
+	/// Converts the 8-bit gray or BGR image to float luma and convolves it with the kernel
+	/// along the rows and along the columns, all in one pass.
+	/// Only the 2r + 1 luma rows under the kernel are kept in a ring buffer,
+	/// so every input row is read exactly once and no gray image is allocated.
+	/// The result matches convolveRows and convolveCols of the converted gray image.
+	/// </summary>
+	/// <param name="Img">The img.</param>
+	/// <returns>std::array, the row and the column convolution</returns>
+	template<typename Kernel>
+	std::array<cv::Mat, 2> convolveLuma(const cv::Mat & Img)
+	{
+		CV_Assert(Img.depth() == CV_8U && (Img.channels() == 1 || Img.channels() == 3));
+
+		const int r = Kernel::radius;
+		std::array<cv::Mat, 2> Ret = {
+			cv::Mat(Img.size(), CV_32F),
+			cv::Mat(Img.size(), CV_32F)
+		};
+		cv::Mat Ring(Kernel::size, Img.cols, CV_32F);
+		int Cached[Kernel::size]; // image row held by each ring slot
+		const float * Rows[Kernel::size];
+
+		for (int i = 0; i < Kernel::size; ++i) {
+			Cached[i] = -1;
+		}
+
+		for (int y = 0; y < Img.rows; ++y) {
+			for (int i = 0; i < Kernel::size; ++i) {
+				const int
+					row = cv::borderInterpolate(y - r + i, Img.rows, cv::BORDER_REFLECT_101),
+					slot = row % Kernel::size;
+
+				if (Cached[slot] != row) {
+					lumaRow(Img.ptr<uchar>(row), Ring.ptr<float>(slot), Img.cols, Img.channels());
+					Cached[slot] = row;
+				}
+				Rows[i] = Ring.ptr<float>(slot);
+			}
+
+			float * dst = Ret[1].ptr<float>(y);
+			for (int x = 0; x < Img.cols; ++x) {
+				dst[x] = Kernel::gather(Rows, x);
+			}
+			convolveRow<Kernel>(Rows[r], Ret[0].ptr<float>(y), Img.cols);
+		}
+
+		return Ret;
+	}
+}
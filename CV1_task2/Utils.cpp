@@ -1,7 +1,15 @@
 #include "Utils.h"
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTILS_SSE2
+#endif
+
 
 Utils::Utils()
 {
@@ -50,62 +58,166 @@ void Utils::drawPointInMat(cv::Mat & Img, const cv::Point & Pnt, uchar Color)
 
 /// <summary>
 /// Convolves the mat with sobel kernel.
+/// Returns the horizontal derivative saturated to the type of the image,
+/// negative values become 0.
 /// </summary>
 /// <param name="Img">The img.</param>
 /// <returns>cv::Mat</returns>
 cv::Mat Utils::convolveMatWithSobel(const cv::Mat & Img)
+{
+  cv::Mat Res, Gx, Gy;
+
+  sobel(Img, Gx, Gy);
+  Gx.convertTo(Res, Img.type());
+
+  return Res;
+}
+
+namespace
+{
+  /// <summary>
+  /// Computes the sobel derivatives for a band of rows.
+  /// </summary>
+  /// <remarks>
+  /// The kernel is split into its vertical and horizontal part:
+  /// Gx = (-1, 0, 1) * (1, 2, 1)T * I
+  /// Gy = (1, 2, 1) * (-1, 0, 1)T * I
+  /// The vertical part (1, 2, 1)T and (-1, 0, 1)T is computed once per row for all channels,
+  /// the horizontal part then combines neighbors that are one pixel (= channels elements) apart.
+  /// </remarks>
+  class SobelBody : public cv::ParallelLoopBody
+  {
+  private:
+    const cv::Mat & _Img;
+    cv::Mat & _Gx;
+    cv::Mat & _Gy;
+    cv::Mat * _Magnitude;
+
+  public:
+    SobelBody(const cv::Mat & Img, cv::Mat & Gx, cv::Mat & Gy, cv::Mat * Magnitude)
+      : _Img(Img), _Gx(Gx), _Gy(Gy), _Magnitude(Magnitude)
+    {
+    }
+
+    void operator()(const cv::Range & Rows) const
+    {
+      const int
+        cn = _Img.channels(),
+        n = _Img.cols * cn; // elements per row
+      std::vector<short>
+        Smooth(n + 2 * cn), // (1, 2, 1)T, one reflected pixel left and right
+        Diff(n + 2 * cn); // (-1, 0, 1)T, one reflected pixel left and right
+
+      for (int r = Rows.start; r < Rows.end; ++r) {
+        const uchar
+          *row_prev = _Img.ptr<uchar>(cv::borderInterpolate(r - 1, _Img.rows, cv::BORDER_REFLECT_101)),
+          *row_cur = _Img.ptr<uchar>(r),
+          *row_next = _Img.ptr<uchar>(cv::borderInterpolate(r + 1, _Img.rows, cv::BORDER_REFLECT_101));
+        short
+          *smooth = &Smooth[cn],
+          *diff = &Diff[cn],
+          *gx = _Gx.ptr<short>(r),
+          *gy = _Gy.ptr<short>(r);
+        int i = 0;
+
+        // vertical
+#ifdef UTILS_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i <= n - 16; i += 16) {
+          __m128i
+            p = _mm_loadu_si128((const __m128i *)(row_prev + i)),
+            c = _mm_loadu_si128((const __m128i *)(row_cur + i)),
+            x = _mm_loadu_si128((const __m128i *)(row_next + i)),
+            p0 = _mm_unpacklo_epi8(p, zero), p1 = _mm_unpackhi_epi8(p, zero),
+            c0 = _mm_unpacklo_epi8(c, zero), c1 = _mm_unpackhi_epi8(c, zero),
+            x0 = _mm_unpacklo_epi8(x, zero), x1 = _mm_unpackhi_epi8(x, zero);
+          _mm_storeu_si128((__m128i *)(smooth + i), _mm_add_epi16(_mm_add_epi16(p0, x0), _mm_add_epi16(c0, c0)));
+          _mm_storeu_si128((__m128i *)(smooth + i + 8), _mm_add_epi16(_mm_add_epi16(p1, x1), _mm_add_epi16(c1, c1)));
+          _mm_storeu_si128((__m128i *)(diff + i), _mm_sub_epi16(x0, p0));
+          _mm_storeu_si128((__m128i *)(diff + i + 8), _mm_sub_epi16(x1, p1));
+        }
+#endif
+        for (; i < n; ++i) {
+          smooth[i] = (short)(row_prev[i] + 2 * row_cur[i] + row_next[i]);
+          diff[i] = (short)(row_next[i] - row_prev[i]);
+        }
+
+        // reflect one pixel at both ends
+        const int
+          left = cv::borderInterpolate(-1, _Img.cols, cv::BORDER_REFLECT_101) * cn,
+          right = cv::borderInterpolate(_Img.cols, _Img.cols, cv::BORDER_REFLECT_101) * cn;
+        for (int k = 0; k < cn; ++k) {
+          smooth[k - cn] = smooth[left + k];
+          diff[k - cn] = diff[left + k];
+          smooth[n + k] = smooth[right + k];
+          diff[n + k] = diff[right + k];
+        }
+
+        // horizontal
+        i = 0;
+#ifdef UTILS_SSE2
+        for (; i <= n - 8; i += 8) {
+          __m128i
+            s_left = _mm_loadu_si128((const __m128i *)(smooth + i - cn)),
+            s_right = _mm_loadu_si128((const __m128i *)(smooth + i + cn)),
+            d_left = _mm_loadu_si128((const __m128i *)(diff + i - cn)),
+            d_cur = _mm_loadu_si128((const __m128i *)(diff + i)),
+            d_right = _mm_loadu_si128((const __m128i *)(diff + i + cn));
+          _mm_storeu_si128((__m128i *)(gx + i), _mm_sub_epi16(s_right, s_left));
+          _mm_storeu_si128((__m128i *)(gy + i), _mm_add_epi16(_mm_add_epi16(d_left, d_right), _mm_add_epi16(d_cur, d_cur)));
+        }
+#endif
+        for (; i < n; ++i) {
+          gx[i] = (short)(smooth[i + cn] - smooth[i - cn]);
+          gy[i] = (short)(diff[i - cn] + 2 * diff[i] + diff[i + cn]);
+        }
+
+        if (_Magnitude) {
+          float *mag = _Magnitude->ptr<float>(r);
+          i = 0;
+#ifdef UTILS_SSE2
+          for (; i <= n - 8; i += 8) {
+            __m128i
+              x = _mm_loadu_si128((const __m128i *)(gx + i)),
+              y = _mm_loadu_si128((const __m128i *)(gy + i));
+            // sign extend to 32 bit
+            __m128
+              x0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)),
+              x1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)),
+              y0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(y, y), 16)),
+              y1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(y, y), 16));
+            _mm_storeu_ps(mag + i, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x0, x0), _mm_mul_ps(y0, y0))));
+            _mm_storeu_ps(mag + i + 4, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x1, x1), _mm_mul_ps(y1, y1))));
+          }
+#endif
+          for (; i < n; ++i) {
+            mag[i] = std::sqrt((float)(gx[i] * gx[i] + gy[i] * gy[i]));
+          }
+        }
+      }
+    }
+  };
+}
+
+/// <summary>
+/// Computes the horizontal and vertical sobel derivatives in one pass.
+/// </summary>
+/// <param name="Img">The img.</param>
+/// <param name="Gx">The horizontal derivative.</param>
+/// <param name="Gy">The vertical derivative.</param>
+/// <param name="Magnitude">The magnitude, optional.</param>
+void Utils::sobel(const cv::Mat & Img, cv::Mat & Gx, cv::Mat & Gy, cv::Mat * Magnitude)
 {
   // Accept only char type matrices
   CV_Assert(Img.depth() == CV_8U);
 
-  cv::Mat Res, PreComputed = cv::Mat_<int>(Img.size());
-  const int row_count = Img.rows - 1;
-  const int col_count = (Img.cols - 1) * Img.channels();
-  int
-		r, // row index
-    c, // column index
-    val_result;
-  const uchar *row_cur,
-    *row_prev,
-    *row_next;
-  uchar *row_res;
-  cv::Point nw, ne, se, sw;
-
-  Res.create(Img.size(), Img.type()); // Create result image with same size and type like the origninal one.
-  Res = cv::Scalar::all(0); // Initialize pixel values with 0.
-  PreComputed = cv::Scalar::all(INT_MAX); // Mat for the precomputet values of the Kernel, initialize with max int to distinguish precalculatet Points from unvisited ones
-
-  for (r = 1; r < row_count; ++r) {
-    // Get pointer to rows
-    row_prev = Img.ptr<uchar>(r - 1);
-    row_cur = Img.ptr<uchar>(r);
-    row_res = Res.ptr<uchar>(r);
-    row_next = Img.ptr<uchar>(r + 1);
-
-    for (c = 1; c < col_count; ++c) {
-      nw = cv::Point(c - 1, r - 1); // |nw ne|
-      ne = cv::Point(c + 1, r - 1); // |sw se|
-      se = cv::Point(c + 1, r + 1);
-      sw = cv::Point(c - 1, r + 1);
-      // Calculate value of the left operator column if there are no previously created ones.
-      if (PreComputed.at<int>(nw) == INT_MAX)
-        PreComputed.at<int>(nw) = row_prev[c - 1] + row_cur[c - 1];
-      if (PreComputed.at<int>(ne) == INT_MAX)
-        PreComputed.at<int>(ne) = row_prev[c + 1] + row_cur[c + 1];
-      if (PreComputed.at<int>(se) == INT_MAX)
-        PreComputed.at<int>(se) = row_next[c + 1] + row_cur[c + 1];
-      if (PreComputed.at<int>(sw) == INT_MAX)
-        PreComputed.at<int>(sw) = row_next[c - 1] + row_cur[c - 1];
-
-      // Calculate the result value
-      val_result = PreComputed.at<int>(ne) + PreComputed.at<int>(se) - PreComputed.at<int>(nw) - PreComputed.at<int>(sw);
-
-      // Write result value to the result image
-      row_res[c] = cv::saturate_cast<uchar>(val_result);
-    }
+  Gx.create(Img.size(), CV_MAKETYPE(CV_16S, Img.channels()));
+  Gy.create(Img.size(), CV_MAKETYPE(CV_16S, Img.channels()));
+  if (Magnitude) {
+    Magnitude->create(Img.size(), CV_MAKETYPE(CV_32F, Img.channels()));
   }
 
-  return Res;
+  cv::parallel_for_(cv::Range(0, Img.rows), SobelBody(Img, Gx, Gy, Magnitude));
 }
 
 cv::Mat Utils::convolveMatWithExpMask1D(const cv::Mat & Img)
@@ -129,3 +241,234 @@ cv::Mat Utils::convolveMatWithExpMask1D(const cv::Mat & Img)
 
   return Res;
 }
+
+namespace
+{
+  /// <summary>
+  /// Horizontal causal and anti-causal exponential passes, in place, for a band of rows.
+  /// Four rows are filtered side by side in the lanes of one register.
+  /// </summary>
+  class ExpRowsBody : public cv::ParallelLoopBody
+  {
+  private:
+    cv::Mat & _Img;
+    const float _Alpha;
+
+#ifdef UTILS_SSE2
+    /// <summary>
+    /// Both passes over four rows of n elements with CN channels, read and written as 4x4 tiles that are
+    /// transposed in registers. The running values of the channels are a queue in registers, the value
+    /// of the channel of the next element at its head, so the channel never indexes memory.
+    /// </summary>
+    template <int CN>
+    static void _rows4(float * rows[4], int n, float a, float b)
+    {
+      const __m128
+        va = _mm_set1_ps(a),
+        vb = _mm_set1_ps(b);
+      const int tiles = n & ~3; // elements covered by whole tiles
+      __m128 y0, y1, y2, y3, t0, t1, t2, t3;
+      float lanes[4];
+
+      // the head of the queue gives the next value, which goes to its back
+      auto forward = [&](__m128 x) -> __m128 {
+        const __m128 y = _mm_add_ps(_mm_mul_ps(vb, x), _mm_mul_ps(va, y0));
+        if (CN == 1) { y0 = y; }
+        if (CN == 2) { y0 = y1; y1 = y; }
+        if (CN == 3) { y0 = y1; y1 = y2; y2 = y; }
+        if (CN == 4) { y0 = y1; y1 = y2; y2 = y3; y3 = y; }
+        return y;
+      };
+      // going backwards the back of the queue is the channel of the next element
+      auto backward = [&](__m128 x) -> __m128 {
+        const __m128 last = CN == 1 ? y0 : CN == 2 ? y1 : CN == 3 ? y2 : y3;
+        const __m128 y = _mm_add_ps(_mm_mul_ps(vb, x), _mm_mul_ps(va, last));
+        if (CN == 1) { y0 = y; }
+        if (CN == 2) { y1 = y0; y0 = y; }
+        if (CN == 3) { y2 = y1; y1 = y0; y0 = y; }
+        if (CN == 4) { y3 = y2; y2 = y1; y1 = y0; y0 = y; }
+        return y;
+      };
+      // an element past the last tile, gathered from the four rows
+      auto gather = [&](int i) {
+        return _mm_setr_ps(rows[0][i], rows[1][i], rows[2][i], rows[3][i]);
+      };
+      auto scatter = [&](int i, __m128 y) {
+        _mm_storeu_ps(lanes, y);
+        rows[0][i] = lanes[0]; rows[1][i] = lanes[1]; rows[2][i] = lanes[2]; rows[3][i] = lanes[3];
+      };
+
+      // causal: y[i] = b * x[i] + a * y[i - CN], starting in steady state, every channel with its first element
+      y0 = gather(0);
+      y1 = CN > 1 ? gather(1) : y0;
+      y2 = CN > 2 ? gather(2) : y0;
+      y3 = CN > 3 ? gather(3) : y0;
+      for (int i = 0; i < tiles; i += 4) {
+        // transposed, tj holds element i + j of the four rows
+        t0 = _mm_loadu_ps(rows[0] + i); t1 = _mm_loadu_ps(rows[1] + i); t2 = _mm_loadu_ps(rows[2] + i); t3 = _mm_loadu_ps(rows[3] + i);
+        _MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+        t0 = forward(t0); t1 = forward(t1); t2 = forward(t2); t3 = forward(t3);
+        _MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+        _mm_storeu_ps(rows[0] + i, t0); _mm_storeu_ps(rows[1] + i, t1); _mm_storeu_ps(rows[2] + i, t2); _mm_storeu_ps(rows[3] + i, t3);
+      }
+      for (int i = tiles; i < n; ++i) scatter(i, forward(gather(i)));
+
+      // anti-causal: z[i] = b * y[i] + a * z[i + CN], starting in steady state, every channel with its last value
+      for (int i = n - 1; i >= tiles; --i) scatter(i, backward(gather(i)));
+      for (int i = tiles - 4; i >= 0; i -= 4) {
+        t0 = _mm_loadu_ps(rows[0] + i); t1 = _mm_loadu_ps(rows[1] + i); t2 = _mm_loadu_ps(rows[2] + i); t3 = _mm_loadu_ps(rows[3] + i);
+        _MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+        t3 = backward(t3); t2 = backward(t2); t1 = backward(t1); t0 = backward(t0);
+        _MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+        _mm_storeu_ps(rows[0] + i, t0); _mm_storeu_ps(rows[1] + i, t1); _mm_storeu_ps(rows[2] + i, t2); _mm_storeu_ps(rows[3] + i, t3);
+      }
+    }
+#endif
+
+  public:
+    ExpRowsBody(cv::Mat & Img, float Alpha)
+      : _Img(Img), _Alpha(Alpha)
+    {
+    }
+
+    void operator()(const cv::Range & Blocks) const
+    {
+      const int
+        cn = _Img.channels(),
+        n = _Img.cols * cn; // elements per row
+      const float
+        a = _Alpha,
+        b = 1.f - _Alpha;
+
+      for (int block = Blocks.start; block < Blocks.end; ++block) {
+        int r = block * 4;
+        const int end = std::min(r + 4, _Img.rows);
+
+#ifdef UTILS_SSE2
+        if (end - r == 4 && cn <= 4) {
+          float *rows[4] = { _Img.ptr<float>(r), _Img.ptr<float>(r + 1), _Img.ptr<float>(r + 2), _Img.ptr<float>(r + 3) };
+          switch (cn) {
+          case 1: _rows4<1>(rows, n, a, b); break;
+          case 2: _rows4<2>(rows, n, a, b); break;
+          case 3: _rows4<3>(rows, n, a, b); break;
+          default: _rows4<4>(rows, n, a, b); break;
+          }
+          continue;
+        }
+#endif
+        for (; r < end; ++r) {
+          float *row = _Img.ptr<float>(r);
+
+          for (int k = 0; k < cn; ++k) {
+            float y = row[k];
+            for (int i = k; i < n; i += cn) {
+              row[i] = y = b * row[i] + a * y;
+            }
+            for (int i = n - cn + k; i >= 0; i -= cn) {
+              row[i] = y = b * row[i] + a * y;
+            }
+          }
+        }
+      }
+    }
+  };
+
+  /// <summary>
+  /// Vertical causal and anti-causal exponential passes, in place, for a strip of columns.
+  /// Every element of a row is independent, so the passes are vectorized along the row.
+  /// </summary>
+  class ExpColsBody : public cv::ParallelLoopBody
+  {
+  private:
+    cv::Mat & _Img;
+    const float _Alpha;
+    const int _Strip;
+
+  public:
+    ExpColsBody(cv::Mat & Img, float Alpha, int Strip)
+      : _Img(Img), _Alpha(Alpha), _Strip(Strip)
+    {
+    }
+
+    void operator()(const cv::Range & Strips) const
+    {
+      const int
+        n = _Img.cols * _Img.channels(),
+        first = Strips.start * _Strip,
+        last = std::min(n, Strips.end * _Strip);
+      const float
+        a = _Alpha,
+        b = 1.f - _Alpha;
+
+      // causal, row 0 is its own steady state
+      for (int r = 1; r < _Img.rows; ++r) {
+        const float *prev = _Img.ptr<float>(r - 1);
+        float *cur = _Img.ptr<float>(r);
+        int i = first;
+#ifdef UTILS_SSE2
+        const __m128
+          va = _mm_set1_ps(a),
+          vb = _mm_set1_ps(b);
+        for (; i <= last - 4; i += 4) {
+          _mm_storeu_ps(cur + i, _mm_add_ps(_mm_mul_ps(vb, _mm_loadu_ps(cur + i)), _mm_mul_ps(va, _mm_loadu_ps(prev + i))));
+        }
+#endif
+        for (; i < last; ++i) {
+          cur[i] = b * cur[i] + a * prev[i];
+        }
+      }
+
+      // anti-causal, the last row is its own steady state
+      for (int r = _Img.rows - 2; r >= 0; --r) {
+        const float *next = _Img.ptr<float>(r + 1);
+        float *cur = _Img.ptr<float>(r);
+        int i = first;
+#ifdef UTILS_SSE2
+        const __m128
+          va = _mm_set1_ps(a),
+          vb = _mm_set1_ps(b);
+        for (; i <= last - 4; i += 4) {
+          _mm_storeu_ps(cur + i, _mm_add_ps(_mm_mul_ps(vb, _mm_loadu_ps(cur + i)), _mm_mul_ps(va, _mm_loadu_ps(next + i))));
+        }
+#endif
+        for (; i < last; ++i) {
+          cur[i] = b * cur[i] + a * next[i];
+        }
+      }
+    }
+  };
+}
+
+/// <summary>
+/// Smoothes the mat with the symmetric exponential mask in both directions.
+/// </summary>
+/// <remarks>
+/// Recursive (IIR) filter, the cost per pixel doesn't depend on the smoothing strength.
+/// Along each row and then along each column a causal pass
+///   y[i] = (1 - a) x[i] + a y[i - 1]
+/// is followed by an anti-causal pass
+///   z[i] = (1 - a) y[i] + a z[i + 1]
+/// The cascade is the normalized symmetric exponential mask
+///   h[k] = (1 - a) / (1 + a) * a^|k|
+/// with variance 2a / (1 - a)^2 per direction.
+/// Both passes start in steady state, i.e. the image is continued with its border values.
+/// </remarks>
+/// <param name="Img">The img.</param>
+/// <param name="Alpha">The smoothing strength a, 0 <= a < 1.</param>
+/// <returns>cv::Mat</returns>
+cv::Mat Utils::smoothExponential(const cv::Mat & Img, float Alpha)
+{
+  CV_Assert(Alpha >= 0.f && Alpha < 1.f);
+
+  cv::Mat Res;
+  const int
+    n = Img.cols * Img.channels(),
+    strip = 256; // floats per column strip
+
+  Img.convertTo(Res, CV_MAKETYPE(CV_32F, Img.channels()));
+
+  cv::parallel_for_(cv::Range(0, (Res.rows + 3) / 4), ExpRowsBody(Res, Alpha));
+  cv::parallel_for_(cv::Range(0, (n + strip - 1) / strip), ExpColsBody(Res, Alpha, strip));
+
+  return Res;
+}
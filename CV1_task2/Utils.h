@@ -53,15 +53,37 @@ public:
 
   /// <summary>
   /// Convolves the mat with sobel.
+  /// Returns the horizontal derivative saturated to the type of the image.
   /// </summary>
   /// <param name="Img">The img.</param>
   /// <returns>cv::Mat</returns>
   static cv::Mat convolveMatWithSobel(const cv::Mat& Img);
 
+  /// <summary>
+  /// Computes the horizontal and vertical sobel derivatives of an 8-bit image in one pass.
+  /// Every channel is filtered on its own, the borders are reflected (BORDER_REFLECT_101).
+  /// Separable, vectorized with SSE2 where available and parallel over the rows.
+  /// </summary>
+  /// <param name="Img">The 8-bit img with any number of channels.</param>
+  /// <param name="Gx">The horizontal derivative, CV_16S with the channels of the img.</param>
+  /// <param name="Gy">The vertical derivative, CV_16S with the channels of the img.</param>
+  /// <param name="Magnitude">If given, the magnitude sqrt(Gx^2 + Gy^2), CV_32F with the channels of the img.</param>
+  static void sobel(const cv::Mat& Img, cv::Mat& Gx, cv::Mat& Gy, cv::Mat* Magnitude = nullptr);
+
   /// <summary>
   /// Convolves the mat with exponentional mask for 1D.
   /// </summary>
   /// <param name="Img">The img.</param>
   /// <returns>cv::Mat</returns>
   static cv::Mat convolveMatWithExpMask1D(const cv::Mat & Img);
+
+  /// <summary>
+  /// Smoothes the mat with the symmetric exponential mask (1 - a) / (1 + a) * a^|k|
+  /// along the rows and the columns, using causal and anti-causal recursive passes.
+  /// Constant cost per pixel for any smoothing strength, vectorized and parallel.
+  /// </summary>
+  /// <param name="Img">The img, any depth and number of channels.</param>
+  /// <param name="Alpha">The smoothing strength a, 0 <= a < 1.</param>
+  /// <returns>cv::Mat, CV_32F with the channels of the img</returns>
+  static cv::Mat smoothExponential(const cv::Mat & Img, float Alpha);
 };
@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -6,6 +11,8 @@
 
 #include "Utils.h"
 #include "HarrisDetector.h"
+#include "Benchmark.h"
+#include "Batch.h"
 
 
 
@@ -31,6 +38,103 @@ auto isOverNineThousand = greaterThan(9000.0f);
 auto isLowerNineThousand = lowerThan(9000.0f);
 auto isBetweenNegOneAndOne = between(-1.0f, 1.0f);
 
+/// <summary>
+/// Benchmarks the detector: --bench [out.json] [images...]
+/// Without images the bundled test images are used.
+/// </summary>
+int runBenchmark(int argc, char** argv) {
+  std::string JsonPath = argc > 2 ? argv[2] : "benchmark.json";
+  std::vector<std::string> Images(argv + std::min(argc, 3), argv + argc);
+  Benchmark Bench;
+
+  if (Images.empty()) {
+    Images = Benchmark::getDefaultImages();
+  }
+
+  for (const std::string & Path : Images) {
+    if (!Bench.run(Path)) {
+      std::cout << "Could not open or find the image " << Path << "." << std::endl;
+    }
+  }
+
+  Bench.print(std::cout);
+  if (!Bench.writeJson(JsonPath)) {
+    std::cout << "Could not write " << JsonPath << "." << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+/// <summary>
+/// Detects the corners of many images without any window:
+/// --batch <dir|list.txt> <out.csv|out.bin> [--threads N] [--top K] [--threshold T]
+/// </summary>
+int runBatch(int argc, char** argv) {
+  if (argc < 4) {
+    std::cout << "Usage: CV1_task2 --batch <dir|list.txt> <out.csv|out.bin> [--threads N] [--top K] [--threshold T]" << std::endl;
+    return -1;
+  }
+
+  Batch::Options Opt;
+  for (int i = 4; i < argc; i += 2) {
+    std::string Name(argv[i]);
+    if (i + 1 == argc) {
+      std::cout << "Missing value for option " << Name << "." << std::endl;
+      return -1;
+    }
+
+    const char * Value = argv[i + 1];
+    char * End = nullptr;
+    if (Name == "--threads") {
+      Opt.Threads = (int)std::strtol(Value, &End, 10);
+    }
+    else if (Name == "--top") {
+      Opt.Top = (int)std::strtol(Value, &End, 10);
+    }
+    else if (Name == "--threshold") {
+      Opt.Threshold = std::strtof(Value, &End);
+    }
+    else {
+      std::cout << "Unknown option " << Name << "." << std::endl;
+      return -1;
+    }
+
+    // the whole value has to be a number
+    if (End == Value || *End != '\0') {
+      std::cout << "Invalid value " << Value << " for option " << Name << "." << std::endl;
+      return -1;
+    }
+  }
+
+  Batch Detection(Opt);
+  if (!Detection.addInput(argv[2])) {
+    std::cout << "No images found in " << argv[2] << "." << std::endl;
+    return -1;
+  }
+
+  const int64 Start = cv::getTickCount();
+  Detection.run();
+  const double Seconds = (cv::getTickCount() - Start) / cv::getTickFrequency();
+
+  size_t Corners = 0, Failed = 0;
+  for (const Batch::Result & R : Detection.getResults()) {
+    Corners += R.Corners.size();
+    if (R.Size.area() == 0) {
+      std::cout << "Could not open or find the image " << R.Image << "." << std::endl;
+      ++Failed;
+    }
+  }
+  std::cout << Detection.getResults().size() - Failed << " images, " << Corners << " corners in " << Seconds << " s" << std::endl;
+
+  if (!Detection.write(argv[3])) {
+    std::cout << "Could not write " << argv[3] << "." << std::endl;
+    return -1;
+  }
+
+  return Failed ? 1 : 0;
+}
+
 int main(int argc, char** argv) {
   cv::Mat ImgOrig,
     ImgHarris;
@@ -39,9 +143,30 @@ int main(int argc, char** argv) {
   // Check if image path is supplied as argument
   if (argc < 2) {
     std::cout << "Path must be applied as commandline argument." << std::endl;
+    std::cout << "Usage: CV1_task2 <image> [K] | --bench [out.json] [images...] | --batch <dir|list.txt> <out.csv|out.bin> [options]" << std::endl;
     return -1;
   }
 
+  if (std::string(argv[1]) == "--bench") {
+    return runBenchmark(argc, argv);
+  }
+  if (std::string(argv[1]) == "--batch") {
+    return runBatch(argc, argv);
+  }
+
+  // the number of corners to show has to be a positive integer
+  int K = 0;
+  if (argc > 2) {
+    char * End = nullptr;
+    long Value = std::strtol(argv[2], &End, 10);
+    if (End == argv[2] || *End != '\0' || Value < 1 || Value > INT_MAX) {
+      std::cout << "Invalid number of corners " << argv[2] << "." << std::endl;
+      std::cout << "Usage: CV1_task2 <image> [K] | --bench [out.json] [images...] | --batch <dir|list.txt> <out.csv|out.bin> [options]" << std::endl;
+      return -1;
+    }
+    K = (int)Value;
+  }
+
   // Read image and check if successful
 	ImgOrig = cv::imread(argv[1]);
   if (ImgOrig.empty()) {
@@ -63,10 +188,19 @@ int main(int argc, char** argv) {
 
 
 
-  std::array<cv::Mat, 2> Derivatives = Harris.getDerivatives();
+  std::array<cv::Mat, 2> Derivatives = Harris.getDerivativesAs(ImgOrig.type());
   cv::imshow("DerivatesIx", Derivatives[0]);
   cv::imshow("DerivatesIy", Derivatives[1]);
-  cv::imshow("Harris", Harris.filterCorners(greaterThan(1000000.0f)));
+  if (K > 0) { // exactly the K strongest corners instead of a fixed threshold
+    cv::Mat Corners(ImgOrig.size(), CV_8UC3, cv::Scalar::all(0));
+    for (const cv::KeyPoint & Corner : Harris.getStrongestCorners(K)) {
+      Corners.at<cv::Vec3b>((int)Corner.pt.y, (int)Corner.pt.x) = cv::Vec3b(0, 0, 255);
+    }
+    cv::imshow("Harris", Corners);
+  }
+  else {
+    cv::imshow("Harris", Harris.filterCorners(greaterThan(1000000.0f)));
+  }
   //std::cout << Harris.getResponse() << std::endl;
 
   cv::waitKey();
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <array>
+#include <string>
 #include <vector>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -78,16 +79,82 @@ private:
 	}
 
 	/// <summary>
-	/// Computes the derivatives.
+	/// Computes the derivatives of the gray image straight from the 8-bit BGR or BGRA image.
+	/// Gray conversion and differentiation happen in one pass, only the three gray rows
+	/// under the kernel are kept, so every input row is read exactly once.
+	/// Other images are converted with cv::cvtColor to a float gray image first.
+	/// The borders are reflected like in cv::filter2D (BORDER_REFLECT_101).
 	/// </summary>
 	/// <param name="Img">The img.</param>
 	/// <returns>std::array</returns>
 	std::array<cv::Mat, 2> _computeDerivatives(const cv::Mat & Img)
 	{
-		std::array<cv::Mat, 2> Ret;
+		const int cn = Img.channels();
+		const bool Fused = Img.depth() == CV_8U && (cn == 3 || cn == 4);
+		cv::Mat Src = Img;
 
-		Ret[0] = _convolveKernel(Img, (cv::Mat_<float>(1, 3) << -1, 0, 1)); // X = I * (-1, 0, 1)
-		Ret[1] = _convolveKernel(Img, (cv::Mat_<float>(3, 1) << -1, 0, 1)); // Y = I * (-1, 0, 1)T
+		if (!Fused) {
+			if (cn != 1) {
+				cv::cvtColor(Img, Src, cv::COLOR_BGR2GRAY);
+			}
+			Src.convertTo(Src, CV_32F);
+		}
+
+		std::array<cv::Mat, 2> Ret = {
+			cv::Mat(Img.size(), CV_32F),
+			cv::Mat(Img.size(), CV_32F)
+		};
+		cv::Mat Gray(3, Img.cols, CV_32F); // ring buffer, image row i is kept in row i % 3
+		int Cached[3] = { -1, -1, -1 };
+		const float *Rows[3];
+		const int w = Img.cols;
+
+		for (int r = 0; r < Img.rows; r++) {
+			for (int i = 0; i < 3; i++) {
+				int row = cv::borderInterpolate(r - 1 + i, Img.rows, cv::BORDER_REFLECT_101);
+				float *gray = Gray.ptr<float>(row % 3);
+
+				if (!Fused) {
+					gray = Src.ptr<float>(row);
+				}
+				else if (Cached[row % 3] != row) {
+					const uchar *src = Img.ptr<uchar>(row);
+					for (int c = 0; c < w; c++, src += cn) {
+						gray[c] = src[0] * 0.114f + src[1] * 0.587f + src[2] * 0.299f; // cv::COLOR_BGR2GRAY
+					}
+					Cached[row % 3] = row;
+				}
+				Rows[i] = gray;
+			}
+
+			float *X = Ret[0].ptr<float>(r);
+			float *Y = Ret[1].ptr<float>(r);
+			// X = I * (-1, 0, 1), zero at the reflected borders
+			X[0] = X[w - 1] = 0.f;
+			for (int c = 1; c < w - 1; c++) {
+				X[c] = Rows[1][c + 1] - Rows[1][c - 1];
+			}
+			// Y = I * (-1, 0, 1)T
+			for (int c = 0; c < w; c++) {
+				Y[c] = Rows[2][c] - Rows[0][c];
+			}
+		}
+
+		return Ret;
+	}
+
+	/// <summary>
+	/// Computes the smoothed structure tensor elements A, B and C from the derivatives.
+	/// </summary>
+	/// <param name="Derivatives">The derivatives.</param>
+	/// <returns>std::array</returns>
+	std::array<cv::Mat, 3> _computeStructureTensor(const std::array<cv::Mat, 2> & Derivatives)
+	{
+		std::array<cv::Mat, 3> Ret;
+
+		Ret[0] = _convolveGaussian(Derivatives[0].mul(Derivatives[0])); // A = X^2 * w
+		Ret[1] = _convolveGaussian(Derivatives[1].mul(Derivatives[1])); // B = Y^2 * w
+		Ret[2] = _convolveGaussian(Derivatives[0].mul(Derivatives[1])); // C = (XY) * w
 
 		return Ret;
 	}
@@ -230,20 +297,10 @@ public:
 	/// </summary>
 	/// <param name="Img">The img.</param>
 	HarrisDetector(const cv::Mat & Img)
-		: _ImgOrig(Img.clone())
+		: _ImgOrig(Img)
 	{
-		cv::Mat WorkingCopy;
-		std::array<cv::Mat, 3> StructureTensor;
-		_ImgOrig.convertTo(WorkingCopy, CV_32F);
-		cv::cvtColor(_ImgOrig, WorkingCopy, cv::COLOR_BGR2GRAY);
-
-		_Derivatives = _computeDerivatives(WorkingCopy);
-
-		StructureTensor[0] = _convolveGaussian(_Derivatives[0].mul(_Derivatives[0])); // A = X^2 * w
-		StructureTensor[1] = _convolveGaussian(_Derivatives[1].mul(_Derivatives[1])); // B = Y^2 * w
-		StructureTensor[2] = _convolveGaussian(_Derivatives[0].mul(_Derivatives[1])); // C = (XY) * w
-
-		_Response = _computeResponse(StructureTensor);
+		_Derivatives = _computeDerivatives(_ImgOrig);
+		_Response = _computeResponse(_computeStructureTensor(_Derivatives));
 	}
 
 	/// <summary>
@@ -281,6 +338,39 @@ public:
 		return Ret;
 	}
 
+	/// <summary>
+	/// Saves the derivatives, the smoothed structure tensor and the response as raw planes with their exact values:
+	/// Ix[Name].plane, Iy[Name].plane, aa[Name].plane, bb[Name].plane, cc[Name].plane and R[Name].plane
+	/// </summary>
+	/// <remarks>
+	/// The tensor is not kept by the detector, it is computed again from the derivatives.
+	/// aa, bb and cc are the names harris() gives the smoothed tensor.
+	/// </remarks>
+	/// <param name="Name">The name appended to every file.</param>
+	/// <returns>false if a plane could not be written</returns>
+	bool savePlanes(const std::string & Name)
+	{
+		std::array<cv::Mat, 3> StructureTensor = _computeStructureTensor(_Derivatives);
+		const std::string Files[6] = {
+			"Ix" + Name + ".plane", "Iy" + Name + ".plane",
+			"aa" + Name + ".plane", "bb" + Name + ".plane", "cc" + Name + ".plane",
+			"R" + Name + ".plane"
+		};
+		const cv::Mat * Planes[6] = {
+			&_Derivatives[0], &_Derivatives[1],
+			&StructureTensor[0], &StructureTensor[1], &StructureTensor[2],
+			&_Response
+		};
+		bool Ret = true;
+
+		for (int i = 0; i < 6; i++) {
+			cv::Mat Plane = Planes[i]->isContinuous() ? *Planes[i] : Planes[i]->clone();
+			Ret = save_plane(Plane.rows, Plane.cols, Plane.type(), Plane.ptr(), Files[i].c_str()) && Ret;
+		}
+
+		return Ret;
+	}
+
 	/// <summary>
 	/// Filters the img by responses.
 	/// If response value greater/lower/... than a threshold, determinded by the compare function,
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <opencv2/core/core.hpp>
 
@@ -16,85 +17,82 @@ private:
 	cv::Mat _ImgL;
 	cv::Mat _ImgR;
 	int _windowSize = 1;
+	// with candidates only the cheapest pairs are kept, in _SparseCosts with their normalized costs in _SparseTable
+	int _Candidates = 0;
+	SPARSE_COSTS _SparseCosts;
+	std::vector<double> _SparseTable;
 
+	// an entry of _TmpTable: normalized cost, left and right keypoint
+	typedef struct {
+		double value;
+		int r;
+		int c;
+	} ASSIGNMENT_EDGE;
 
+	// by value, ties by row, then column
+	static bool cheaper(const ASSIGNMENT_EDGE & a, const ASSIGNMENT_EDGE & b) {
+		if (a.value != b.value) return a.value < b.value;
+		return a.r != b.r ? a.r < b.r : a.c < b.c;
+	}
+
+	// SAD of two patches, the Hamming distance of two BRIEF descriptors, the squared distance of two PCA ones
+	// or 1 - NCC of two NCC ones
+	static double descriptorDistance(const DESCRIPTORS & descl, int r, const DESCRIPTORS & descr, int c) {
+		const unsigned char *a = descriptor(&descl, r);
+		const unsigned char *b = descriptor(&descr, c);
+		if (descl.mode == DESCRIPTOR_BRIEF) return descriptor_hamming(a, b);
+		if (descl.mode == DESCRIPTOR_PCA) return descriptor_l2(a, b, descl.stride);
+		if (descl.mode == DESCRIPTOR_NCC) return descriptor_ncc(&descl, r, &descr, c);
+		return descriptor_sad(a, b, descl.stride);
+	}
 
-	double calculateColorDistance(
-		int heightl, int widthl, unsigned char *imgl, int il, int jl,
-		int heightr, int widthr, unsigned char *imgr, int ir, int jr,
-		int wsize
-	) {
-		// filter out points that are close to borders
-	//if (il - wsize < 0) { return std::numeric_limits<double>::max(); }
-	//if (ir - wsize < 0) { return std::numeric_limits<double>::max(); }
-	//if (il + wsize > heightl - 1) { return std::numeric_limits<double>::max(); }
-	//if (ir + wsize > heightr - 1) { return std::numeric_limits<double>::max(); }
-	//if (jl - wsize < 0) { return std::numeric_limits<double>::max(); }
-	//if (jr - wsize < 0) { return std::numeric_limits<double>::max(); }
-	//if (jl + wsize > widthl - 1) { return std::numeric_limits<double>::max(); }
-	//if (jr + wsize > widthr - 1) { return std::numeric_limits<double>::max(); }
-
-	if (il - wsize < 0) { return INT_MAX; }
-	if (ir - wsize < 0) { return INT_MAX; }
-	if (il + wsize > heightl - 1) { return INT_MAX; }
-	if (ir + wsize > heightr - 1) { return INT_MAX; }
-	if (jl - wsize < 0) { return INT_MAX; }
-	if (jr - wsize < 0) { return INT_MAX; }
-	if (jl + wsize > widthl - 1) { return INT_MAX; }
-	if (jr + wsize > widthr - 1) { return INT_MAX; }
-
-		double q = 0.;
-		for (int di = -wsize; di <= wsize; di++) {
-			for (int dj = -wsize; dj <= wsize; dj++) {
-				int indexl = ((il + di)*widthl + jl + dj) * 3;
-				int indexr = ((ir + di)*widthr + jr + dj) * 3;
-				double dr = std::abs(imgl[indexl] - imgr[indexr]);
-				double dg = std::abs(imgl[indexl + 1] - imgr[indexr + 1]);
-				double db = std::abs(imgl[indexl + 2] - imgr[indexr + 2]);
-				q += dr + dg + db;
+	// costs of the left keypoint r to all right keypoints, INT_MAX for the pairs that are not compared
+	void fillRow(int r, double * row, const DESCRIPTORS & descl, const DESCRIPTORS & descr,
+		const GUIDE * guide, const KEYPOINT_GRID & grid, std::vector<int> & candidates) const {
+		if (guide) {
+			for (size_t c = 0; c < _PointsR.size(); c++) row[c] = INT_MAX;
+			double x, y;
+			if (!descl.valid[r] || !guide_predict(guide, _PointsL[r].x, _PointsL[r].y, &x, &y)) return;
+			query_keypoint_grid(&grid, _PointsR, x, y, guide->radius, candidates);
+			for (size_t k = 0; k < candidates.size(); k++) {
+				int c = candidates[k];
+				if (descr.valid[c]) row[c] = descriptorDistance(descl, r, descr, c);
 			}
+			return;
+		}
+		for (size_t c = 0; c < _PointsR.size(); c++) {
+			// points that are close to borders never match
+			row[c] = descl.valid[r] && descr.valid[c]
+				? descriptorDistance(descl, r, descr, (int)c)
+				: INT_MAX;
 		}
-		return q;
 	}
 
-public:
-	Matching(
-		const cv::Mat & ImgL,
-		const cv::Mat & ImgR,
-		std::vector<KEYPOINT> & pointsl,
-		std::vector<KEYPOINT> & pointsr,
-		int wsize
-	) :
-		_ImgL(ImgL),
-		_ImgR(ImgR),
-		_PointsL(pointsl),
-		_PointsR(pointsr),
-		_windowSize(wsize)
-	{
+	// _CostTable with all pairs and _TmpTable with their normalized costs
+	void fillDense(const DESCRIPTORS & descl, const DESCRIPTORS & descr, const GUIDE * guide, const KEYPOINT_GRID & grid) {
 		// "weighted frequency method" by Habr can work on asymetric matrices
-		_CostTable = cv::Mat(pointsl.size(), pointsr.size(), CV_64F, 0.0);
+		_CostTable = cv::Mat(_PointsL.size(), _PointsR.size(), CV_64F, 0.0);
 
 		// fill _CostTable
+		std::vector<int> candidates;
 		for (size_t r = 0; r < _PointsL.size(); r++) {
-			for (size_t c = 0; c < _PointsR.size(); c++) {
-				_CostTable.at<double>(r, c) = calculateColorDistance(
-					_ImgL.rows, _ImgL.cols, _ImgL.ptr(0), (int)(_PointsL[r].y + 0.5), (int)(_PointsL[r].x + 0.5),
-					_ImgR.rows, _ImgR.cols, _ImgR.ptr(0), (int)(_PointsR[c].y + 0.5), (int)(_PointsR[c].x + 0.5),
-					_windowSize
-				);
-			}
+			fillRow((int)r, _CostTable.ptr<double>((int)r), descl, descr, guide, grid, candidates);
 		}
 
+		// with a guide the pairs that were not compared count for no average and are never picked
 		_TmpTable = _CostTable.clone();
 		double tableAvg = 0.0;
 		// subtract row avg from _TmpTable
 		double avg = 0.0;
 		for (size_t r = 0; r < _CostTable.rows; r++) {
 			avg = 0.0;
+			int n = 0;
 			for (size_t c = 0; c < _CostTable.cols; c++) {
+				if (guide && _CostTable.at<double>(r, c) >= INT_MAX) continue;
 				avg += _CostTable.at<double>(r, c);
+				n++;
 			}
-			avg /= _CostTable.rows;
+			avg /= guide ? std::max(n, 1) : _CostTable.rows;
 			for (size_t c = 0; c < _CostTable.cols; c++) {
 				_TmpTable.at<double>(r, c) -= avg;
 			}
@@ -104,10 +102,13 @@ public:
 		// subtract column avg from _TmpTable
 		for (size_t c = 0; c < _CostTable.cols; c++) {
 			avg = 0.0;
+			int n = 0;
 			for (size_t r = 0; r < _CostTable.rows; r++) {
+				if (guide && _CostTable.at<double>(r, c) >= INT_MAX) continue;
 				avg += _CostTable.at<double>(r, c);
+				n++;
 			}
-			avg /= _CostTable.rows;
+			avg /= guide ? std::max(n, 1) : _CostTable.rows;
 			for (size_t r = 0; r < _CostTable.rows; r++) {
 				_TmpTable.at<double>(r, c) -= avg;
 			}
@@ -119,38 +120,189 @@ public:
 		for (size_t r = 0; r < _CostTable.rows; r++) {
 			for (size_t c = 0; c < _CostTable.cols; c++) {
 				_TmpTable.at<double>(r, c) += tableAvg;
+				if (guide && _CostTable.at<double>(r, c) >= INT_MAX) _TmpTable.at<double>(r, c) = std::numeric_limits<double>::max();
 			}
 		}
+	}
 
-		// find matrix minimum
-		size_t maxNumberMatches = _PointsL.size() < _PointsR.size() ? _PointsL.size() : _PointsR.size();
-		double minimum = 0.0;
-		size_t count = 0;
-		cv::Point minLoc(0,0);
-		do {
-			// find minimum in matrix
-			cv::minMaxLoc(_TmpTable, &minimum, NULL, &minLoc, NULL);
-			//if (minimum < std::numeric_limits<double>::max()) {
-			if (minimum < INT_MAX) {
-				// remove column and row of found minimum
-				for (size_t r = 0; r < _TmpTable.rows; r++) {
-					_TmpTable.at<double>(r, minLoc.x) = std::numeric_limits<double>::max();
+	// _SparseCosts and _SparseTable: the _Candidates cheapest pairs of every row and of every column, one row
+	// computed at a time. The averages still cover all pairs, so every kept entry is normalized as in _TmpTable.
+	void fillSparse(const DESCRIPTORS & descl, const DESCRIPTORS & descr, const GUIDE * guide, const KEYPOINT_GRID & grid) {
+		int rows = (int)_PointsL.size();
+		int cols = (int)_PointsR.size();
+		size_t k = (size_t)_Candidates;
+		std::vector<double> row(cols), rowAvg(rows), colAvg(cols, 0.0);
+		std::vector<int> colCount(cols, 0);
+		std::vector<int> candidates;
+		std::vector<ASSIGNMENT_EDGE> kept, rowBest;
+		std::vector<std::vector<ASSIGNMENT_EDGE> > colBest(cols); // max-heaps on cheaper(), the most expensive on top
+
+		for (int r = 0; r < rows; r++) {
+			fillRow(r, row.data(), descl, descr, guide, grid, candidates);
+			double avg = 0.0;
+			int n = 0;
+			rowBest.clear();
+			for (int c = 0; c < cols; c++) {
+				// with a guide the pairs that were not compared count for no average and are never kept
+				if (guide && row[c] >= INT_MAX) continue;
+				avg += row[c];
+				n++;
+				colAvg[c] += row[c];
+				colCount[c]++;
+				ASSIGNMENT_EDGE edge = { row[c], r, c };
+				rowBest.push_back(edge);
+				std::vector<ASSIGNMENT_EDGE> & heap = colBest[c];
+				if (heap.size() < k) {
+					heap.push_back(edge);
+					std::push_heap(heap.begin(), heap.end(), cheaper);
 				}
-				for (size_t c = 0; c < _TmpTable.cols; c++) {
-					_TmpTable.at<double>(minLoc.y, c) = std::numeric_limits<double>::max();
+				else if (cheaper(edge, heap.front())) {
+					std::pop_heap(heap.begin(), heap.end(), cheaper);
+					heap.back() = edge;
+					std::push_heap(heap.begin(), heap.end(), cheaper);
 				}
-				// save match
-				MATCH match;
-				match.value = minimum;
-				match.xl = _PointsL[minLoc.y].x;
-				match.yl = _PointsL[minLoc.y].y;
-				match.xr = _PointsR[minLoc.x].x;
-				match.yr = _PointsR[minLoc.x].y;
-				_Matches.push_back(match);
 			}
-			count++;
-		} while (minimum < std::numeric_limits<double>::max() && count < maxNumberMatches);
+			rowAvg[r] = avg / (guide ? std::max(n, 1) : rows);
+			if (rowBest.size() > k) {
+				std::nth_element(rowBest.begin(), rowBest.begin() + k, rowBest.end(), cheaper);
+				rowBest.resize(k);
+			}
+			kept.insert(kept.end(), rowBest.begin(), rowBest.end());
+		}
+		for (int c = 0; c < cols; c++) {
+			kept.insert(kept.end(), colBest[c].begin(), colBest[c].end());
+			std::vector<ASSIGNMENT_EDGE>().swap(colBest[c]);
+			colAvg[c] /= guide ? std::max(colCount[c], 1) : rows;
+		}
+
+		// entries kept for their row and for their column once
+		std::sort(kept.begin(), kept.end(), [](const ASSIGNMENT_EDGE & a, const ASSIGNMENT_EDGE & b) {
+			return a.r != b.r ? a.r < b.r : a.c < b.c;
+		});
+		kept.erase(std::unique(kept.begin(), kept.end(), [](const ASSIGNMENT_EDGE & a, const ASSIGNMENT_EDGE & b) {
+			return a.r == b.r && a.c == b.c;
+		}), kept.end());
+
+		double tableAvg = 0.0;
+		for (int r = 0; r < rows; r++) tableAvg += rowAvg[r];
+		for (int c = 0; c < cols; c++) tableAvg += colAvg[c];
+		tableAvg /= (rows + cols);
+
+		_SparseCosts.rows = rows;
+		_SparseCosts.cols = cols;
+		_SparseCosts.start.assign(rows + 1, 0);
+		_SparseCosts.index.resize(kept.size());
+		_SparseCosts.cost.resize(kept.size());
+		_SparseTable.resize(kept.size());
+		for (size_t e = 0; e < kept.size(); e++) {
+			const ASSIGNMENT_EDGE & edge = kept[e];
+			_SparseCosts.start[edge.r + 1]++;
+			_SparseCosts.index[e] = edge.c;
+			_SparseCosts.cost[e] = edge.value;
+			double value = edge.value - rowAvg[edge.r];
+			value -= colAvg[edge.c];
+			_SparseTable[e] = value + tableAvg;
+		}
+		for (int r = 0; r < rows; r++) _SparseCosts.start[r + 1] += _SparseCosts.start[r];
+	}
+
+	void addMatch(int r, int c, double value) {
+		MATCH match;
+		match.value = value;
+		match.xl = _PointsL[r].x;
+		match.yl = _PointsL[r].y;
+		match.xr = _PointsR[c].x;
+		match.yr = _PointsR[c].y;
+		_Matches.push_back(match);
+	}
+
+	// greedy assignment: the entries of _TmpTable (or _SparseTable) in ascending order, each one is taken while its row and column
+	// are free. Ties go by row, then column, the order in which a scan of the table finds its first minimum.
+	// Entries at or above INT_MAX are never taken.
+	void assignGreedy() {
+		std::vector<ASSIGNMENT_EDGE> edges;
+		if (_Candidates > 0) {
+			for (int r = 0; r < _SparseCosts.rows; r++) {
+				for (int e = _SparseCosts.start[r]; e < _SparseCosts.start[r + 1]; e++) {
+					if (_SparseTable[e] < INT_MAX) edges.push_back(ASSIGNMENT_EDGE{ _SparseTable[e], r, _SparseCosts.index[e] });
+				}
+			}
+		}
+		else {
+			edges.reserve((size_t)_TmpTable.rows*_TmpTable.cols);
+			for (int r = 0; r < _TmpTable.rows; r++) {
+				const double *row = _TmpTable.ptr<double>(r);
+				for (int c = 0; c < _TmpTable.cols; c++) {
+					if (row[c] < INT_MAX) edges.push_back(ASSIGNMENT_EDGE{ row[c], r, c });
+				}
+			}
+		}
+		std::sort(edges.begin(), edges.end(), cheaper);
+
+		size_t maxNumberMatches = _PointsL.size() < _PointsR.size() ? _PointsL.size() : _PointsR.size();
+		std::vector<bool> usedL(_PointsL.size(), false), usedR(_PointsR.size(), false);
+		for (size_t k = 0; k < edges.size() && _Matches.size() < maxNumberMatches; k++) {
+			const ASSIGNMENT_EDGE &edge = edges[k];
+			if (usedL[edge.r] || usedR[edge.c]) continue;
+			usedL[edge.r] = usedR[edge.c] = true;
+			addMatch(edge.r, edge.c, edge.value);
+		}
+	}
+
+	// optimal assignment: the smallest sum of _CostTable (or _SparseCosts) over the pairs, the value of a match
+	// is still its normalized cost, the matches come in the order of the left keypoints
+	void assignAuction(double epsilon) {
+		std::vector<int> assigned(_PointsL.size());
+		if (_Candidates > 0) auction_assignment_sparse(&_SparseCosts, epsilon, assigned.data());
+		else auction_assignment(_CostTable, epsilon, assigned.data());
+		for (int r = 0; r < (int)assigned.size(); r++) {
+			if (assigned[r] == -1) continue;
+			if (_Candidates > 0) {
+				const int *first = _SparseCosts.index.data() + _SparseCosts.start[r];
+				const int *last = _SparseCosts.index.data() + _SparseCosts.start[r + 1];
+				addMatch(r, assigned[r], _SparseTable[std::lower_bound(first, last, assigned[r]) - _SparseCosts.index.data()]);
+			}
+			else {
+				addMatch(r, assigned[r], _TmpTable.at<double>(r, assigned[r]));
+			}
+		}
+	}
+
+public:
+	Matching(
+		const cv::Mat & ImgL,
+		const cv::Mat & ImgR,
+		std::vector<KEYPOINT> & pointsl,
+		std::vector<KEYPOINT> & pointsr,
+		int wsize,
+		const GUIDE * guide = NULL,
+		DESCRIPTOR_MODE mode = DESCRIPTOR_PATCH,
+		ASSIGNMENT assignment = ASSIGNMENT_GREEDY,
+		double epsilon = AUCTION_EPSILON,
+		int candidates = 0
+	) :
+		_ImgL(ImgL),
+		_ImgR(ImgR),
+		_PointsL(pointsl),
+		_PointsR(pointsr),
+		_windowSize(wsize),
+		_Candidates(candidates)
+	{
+		// every descriptor is extracted once
+		DESCRIPTORS descl, descr;
+		extract_descriptor_pair(_ImgL.rows, _ImgL.cols, _ImgL.ptr(0), _ImgR.rows, _ImgR.cols, _ImgR.ptr(0),
+			_PointsL, _PointsR, _windowSize, mode, &descl, &descr);
+		KEYPOINT_GRID grid;
+		// pairs away from the prediction are not compared at all
+		if (guide) build_keypoint_grid(_PointsR, guide->radius, &grid);
+
+		if (_Candidates > 0) fillSparse(descl, descr, guide, grid);
+		else fillDense(descl, descr, guide, grid);
+		free_descriptors(&descl);
+		free_descriptors(&descr);
 
+		if (assignment == ASSIGNMENT_AUCTION) assignAuction(epsilon);
+		else assignGreedy();
 	}
 
 	~Matching() {}
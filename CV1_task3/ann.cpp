@@ -0,0 +1,230 @@
+// approximate nearest neighbours of patch descriptors: a forest of randomized k-d trees,
+// searched best bin first over all trees together until checks descriptors are compared
+#include <climits>
+#include <queue>
+#include <algorithm>
+using namespace std;
+#include "ps.h"
+
+// descriptors in a leaf
+#define ANN_LEAF 8
+
+// descriptors and dimensions sampled for the split of a node, the split takes one of the
+// ANN_CANDIDATES sampled dimensions with the highest variance at random
+#define ANN_SAMPLE 100
+#define ANN_DIMS 64
+#define ANN_CANDIDATES 5
+
+// builds the trees [range.start,range.end), every tree with its own seed
+class AnnBuildBody : public cv::ParallelLoopBody {
+public:
+	AnnBuildBody(ANN_INDEX *index) : index(index) {}
+
+	void operator()(const cv::Range &range) const {
+		const DESCRIPTORS *desc = index->desc;
+		for (int t = range.start; t < range.end; t++) {
+			cv::RNG rng(0x9e3779b9u + t);
+			vector<int> &indices = index->indices[t];
+			indices.clear();
+			for (int k = 0; k < desc->count; k++) {
+				if (desc->valid[k]) indices.push_back(k);
+			}
+			index->nodes[t].clear();
+			build(index->nodes[t], indices, 0, (int)indices.size(), rng);
+		}
+	}
+
+private:
+	// node of indices [begin,end), returns its position
+	int build(vector<ANN_NODE> &nodes, vector<int> &indices, int begin, int end, cv::RNG &rng) const {
+		const DESCRIPTORS *desc = index->desc;
+		int ret = (int)nodes.size();
+		ANN_NODE node = { -1, 0., begin, end };
+		nodes.push_back(node);
+		if (end - begin <= ANN_LEAF) return ret;
+
+		// variance of a few random dimensions on a few random descriptors
+		int n = end - begin < ANN_SAMPLE ? end - begin : ANN_SAMPLE;
+		int dims[ANN_DIMS];
+		double var[ANN_DIMS];
+		int order[ANN_DIMS];
+		for (int d = 0; d < ANN_DIMS; d++) {
+			dims[d] = rng.uniform(0, desc->length);
+			double sum = 0., sum2 = 0.;
+			for (int k = 0; k < n; k++) {
+				double v = descriptor(desc, indices[begin + (size_t)(end - begin)*k / n])[dims[d]];
+				sum += v;
+				sum2 += v*v;
+			}
+			var[d] = sum2 - sum*sum / n;
+			order[d] = d;
+		}
+		partial_sort(order, order + ANN_CANDIDATES, order + ANN_DIMS, [&var](int a, int b) { return var[a] > var[b]; });
+		int dim = dims[order[rng.uniform(0, ANN_CANDIDATES)]];
+
+		// split at the mean, an empty side splits in the middle of the indices instead
+		double split = 0.;
+		for (int k = begin; k < end; k++) split += descriptor(desc, indices[k])[dim];
+		split /= end - begin;
+		int mid = (int)(partition(indices.begin() + begin, indices.begin() + end,
+			[desc, dim, split](int k) { return descriptor(desc, k)[dim] < split; }) - indices.begin());
+		if (mid == begin || mid == end) {
+			mid = (begin + end) / 2;
+			nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+				[desc, dim](int a, int b) { return descriptor(desc, a)[dim] < descriptor(desc, b)[dim]; });
+			split = descriptor(desc, indices[mid])[dim];
+		}
+
+		int left = build(nodes, indices, begin, mid, rng);
+		int right = build(nodes, indices, mid, end, rng);
+		nodes[ret].dim = dim;
+		nodes[ret].split = split;
+		nodes[ret].left = left;
+		nodes[ret].right = right;
+		return ret;
+	}
+
+	ANN_INDEX *index;
+};
+
+void build_ann_index(const DESCRIPTORS *desc, int trees, ANN_INDEX *index) {
+	index->desc = desc;
+	index->nodes.assign(trees > 0 ? trees : 1, vector<ANN_NODE>());
+	index->indices.assign(index->nodes.size(), vector<int>());
+	cv::parallel_for_(cv::Range(0, (int)index->nodes.size()), AnnBuildBody(index));
+}
+
+// a branch not taken: lower bound of the SSD to its cell, tree, node and its last entry in the offsets
+typedef struct {
+	double key;
+	int tree;
+	int node;
+	int offset;
+} ANN_BRANCH;
+
+// offset of the query from a cell in one byte, the offsets of a cell are a chain towards the root,
+// a byte split again further down has its latest offset first
+typedef struct {
+	int dim;
+	double d;
+	int parent;
+} ANN_OFFSET;
+
+// nearest neighbours of the queries [range.start,range.end)
+class AnnQueryBody : public cv::ParallelLoopBody {
+public:
+	AnnQueryBody(const ANN_INDEX *index, const DESCRIPTORS *queries, int checks, int *nearest, double *dist)
+		: index(index), queries(queries), checks(checks), nearest(nearest), dist(dist) {}
+
+	void operator()(const cv::Range &range) const {
+		vector<int> seen(index->desc->count, -1); // last query that compared the descriptor
+		vector<ANN_OFFSET> offsets;
+		auto later = [](const ANN_BRANCH &a, const ANN_BRANCH &b) { return a.key > b.key; };
+
+		for (int q = range.start; q < range.end; q++) {
+			nearest[q] = -1;
+			dist[q] = numeric_limits<double>::max();
+			if (!queries->valid[q]) continue;
+
+			const unsigned char *query = descriptor(queries, q);
+			priority_queue<ANN_BRANCH, vector<ANN_BRANCH>, decltype(later)> branches(later);
+			offsets.clear();
+			for (int t = 0; t < (int)index->nodes.size(); t++) {
+				if (!index->nodes[t].empty()) branches.push(ANN_BRANCH{ 0., t, 0, -1 });
+			}
+
+			int compared = 0;
+			while (!branches.empty() && (checks <= 0 || compared < checks)) {
+				ANN_BRANCH branch = branches.top();
+				branches.pop();
+				// no cell left that can hold a nearer descriptor (an equal one may still have a lower index)
+				if (branch.key > dist[q]) break;
+
+				// down to a leaf, the other sides wait in the queue; the near side keeps the offsets of the cell,
+				// the far side replaces the offset in the split byte (as in FLANN's exact search)
+				const vector<ANN_NODE> &nodes = index->nodes[branch.tree];
+				int n = branch.node;
+				while (nodes[n].dim >= 0) {
+					int dim = nodes[n].dim;
+					double d = query[dim] - nodes[n].split;
+					int near = d < 0. ? nodes[n].left : nodes[n].right;
+					int far = d < 0. ? nodes[n].right : nodes[n].left;
+					int e = branch.offset;
+					while (e != -1 && offsets[e].dim != dim) e = offsets[e].parent;
+					double old = e != -1 ? offsets[e].d : 0.;
+					offsets.push_back(ANN_OFFSET{ dim, d, branch.offset });
+					branches.push(ANN_BRANCH{ branch.key - old*old + d*d, branch.tree, far, (int)offsets.size() - 1 });
+					n = near;
+				}
+
+				const vector<int> &indices = index->indices[branch.tree];
+				for (int k = nodes[n].left; k < nodes[n].right; k++) {
+					int i = indices[k];
+					if (seen[i] == q) continue;
+					seen[i] = q;
+					compared++;
+					// stop above the best, a sum equal to it is complete then
+					double bound = dist[q] + 1.;
+					unsigned int limit = bound < UINT_MAX ? (unsigned int)bound : UINT_MAX;
+					double s = descriptor_ssd_bounded(query, descriptor(index->desc, i), queries->stride, limit);
+					if (s < dist[q] || (s == dist[q] && i < nearest[q])) {
+						dist[q] = s;
+						nearest[q] = i;
+					}
+				}
+			}
+		}
+	}
+
+private:
+	const ANN_INDEX *index;
+	const DESCRIPTORS *queries;
+	int checks;
+	int *nearest;
+	double *dist;
+};
+
+void query_ann_index(const ANN_INDEX *index, const DESCRIPTORS *queries, int checks, int *nearest, double *dist) {
+	cv::parallel_for_(cv::Range(0, queries->count), AnnQueryBody(index, queries, checks, nearest, dist));
+}
+
+vector<MATCH> matching_ann(
+	int heightl, int widthl, unsigned char *imgl,
+	int heightr, int widthr, unsigned char *imgr,
+	const vector<KEYPOINT> &pointsl, const vector<KEYPOINT> &pointsr, int wsize,
+	int trees, int checks
+) {
+	int nl = pointsl.size();
+	int nr = pointsr.size();
+	DESCRIPTORS descl, descr;
+	extract_descriptors(heightl, widthl, imgl, pointsl, wsize, &descl);
+	extract_descriptors(heightr, widthr, imgr, pointsr, wsize, &descr);
+
+	// nearest right keypoint of every left one and the other way round
+	vector<int> pl(nl), pr(nr);
+	vector<double> ql(nl), qr(nr);
+	ANN_INDEX index;
+	build_ann_index(&descr, trees, &index);
+	query_ann_index(&index, &descl, checks, pl.data(), ql.data());
+	build_ann_index(&descl, trees, &index);
+	query_ann_index(&index, &descr, checks, pr.data(), qr.data());
+
+	free_descriptors(&descl);
+	free_descriptors(&descr);
+
+	// cross-check and fill
+	vector<MATCH> ret;
+	for (int il = 0; il < nl; il++) {
+		if (pl[il] != -1 && pr[pl[il]] == il) {
+			MATCH pair;
+			pair.xl = pointsl[il].x;
+			pair.yl = pointsl[il].y;
+			pair.xr = pointsr[pl[il]].x;
+			pair.yr = pointsr[pl[il]].y;
+			pair.value = ql[il];
+			ret.push_back(pair);
+		}
+	}
+
+	return ret;
+}
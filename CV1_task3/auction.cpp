@@ -0,0 +1,254 @@
+// optimal assignment by a forward auction (Bertsekas) with epsilon scaling: the rows bid for the columns,
+// a bid raises the price of the column by the margin to the second best column plus epsilon.
+// The rectangular table is padded to a square one, padding and entries at or above INT_MAX cost more than
+// leaving a real entry out, so a row that ends up on one of them is not assigned at all.
+// All rows without a column bid at once (Jacobi), every column takes its highest bid afterwards.
+#include <climits>
+#include <algorithm>
+using namespace std;
+#include "ps.h"
+
+// epsilon is divided by this between two rounds of the auction, the prices of a round start the next one
+#define AUCTION_SCALING 8
+
+// fewer bidders bid on the calling thread, the end of an auction is long chains of single bids
+#define AUCTION_PARALLEL 64
+
+// the square problem of a dense table: padding and entries at or above INT_MAX cost missing
+class DenseAuction {
+public:
+	DenseAuction(const cv::Mat &cost, int n, double missing) : cost(cost), n(n), missing(missing) {}
+
+	// best and second best value of row i, strict < keeps the first column of a tie
+	void best(int i, const double *price, int *j1, double *v1, double *v2) const {
+		const double *row = i < cost.rows ? cost.ptr<double>(i) : NULL;
+		*v1 = *v2 = numeric_limits<double>::max();
+		*j1 = 0;
+		for (int j = 0; j < n; j++) {
+			double c = row && j < cost.cols && row[j] < INT_MAX ? row[j] : missing;
+			double v = c + price[j];
+			if (v < *v1) {
+				*v2 = *v1;
+				*v1 = v;
+				*j1 = j;
+			}
+			else if (v < *v2) {
+				*v2 = v;
+			}
+		}
+	}
+
+private:
+	const cv::Mat &cost;
+	int n;
+	double missing;
+};
+
+// the square problem of a sparse table, every row has its entries only
+class SparseAuction {
+public:
+	SparseAuction(const vector<int> &start, const vector<int> &index, const vector<double> &cost)
+		: start(start), index(index), cost(cost) {}
+
+	void best(int i, const double *price, int *j1, double *v1, double *v2) const {
+		*v1 = *v2 = numeric_limits<double>::max();
+		*j1 = index[start[i]];
+		for (int k = start[i]; k < start[i + 1]; k++) {
+			double v = cost[k] + price[index[k]];
+			if (v < *v1) {
+				*v2 = *v1;
+				*v1 = v;
+				*j1 = index[k];
+			}
+			else if (v < *v2) {
+				*v2 = v;
+			}
+		}
+	}
+
+private:
+	const vector<int> &start;
+	const vector<int> &index;
+	const vector<double> &cost;
+};
+
+// bids of the rows bidders[range.start,range.end): column and its new price
+template <class Problem>
+class AuctionBidBody : public cv::ParallelLoopBody {
+public:
+	AuctionBidBody(const Problem &problem, double epsilon, const double *price, const int *bidders, int *target, double *bid)
+		: problem(problem), epsilon(epsilon), price(price), bidders(bidders), target(target), bid(bid) {}
+
+	void operator()(const cv::Range &range) const {
+		for (int b = range.start; b < range.end; b++) {
+			int j1;
+			double v1, v2;
+			problem.best(bidders[b], price, &j1, &v1, &v2);
+			// a single column: no margin
+			if (v2 == numeric_limits<double>::max()) v2 = v1;
+			target[b] = j1;
+			bid[b] = price[j1] + (v2 - v1) + epsilon;
+		}
+	}
+
+private:
+	const Problem &problem;
+	double epsilon;
+	const double *price;
+	const int *bidders;
+	int *target;
+	double *bid;
+};
+
+// column of every row of the square problem of n rows, whose costs span range
+template <class Problem>
+static vector<int> auction(const Problem &problem, int n, double range, double epsilon) {
+	double final_epsilon = epsilon > 0. ? epsilon : 1. / (n + 1);
+
+	vector<double> price(n, 0.);
+	vector<int> person(n), owner(n); // column of a row, row of a column
+	vector<int> bidders, target(n), winner(n, -1);
+	vector<double> bid(n), best(n);
+	vector<int> touched, next;
+
+	double eps = max(range / AUCTION_SCALING, final_epsilon);
+	for (;;) {
+		fill(person.begin(), person.end(), -1);
+		fill(owner.begin(), owner.end(), -1);
+		bidders.resize(n);
+		for (int i = 0; i < n; i++) bidders[i] = i;
+
+		while (!bidders.empty()) {
+			int count = (int)bidders.size();
+			AuctionBidBody<Problem> body(problem, eps, price.data(), bidders.data(), target.data(), bid.data());
+			if (count < AUCTION_PARALLEL) body(cv::Range(0, count));
+			else cv::parallel_for_(cv::Range(0, count), body);
+
+			// every column takes its highest bid, the lower row on equal bids
+			touched.clear();
+			for (int b = 0; b < count; b++) {
+				int j = target[b];
+				if (winner[j] == -1) {
+					touched.push_back(j);
+					winner[j] = bidders[b];
+					best[j] = bid[b];
+				}
+				else if (bid[b] > best[j] || (bid[b] == best[j] && bidders[b] < winner[j])) {
+					winner[j] = bidders[b];
+					best[j] = bid[b];
+				}
+			}
+
+			// losers and the rows that lost their column bid again
+			next.clear();
+			for (int b = 0; b < count; b++) {
+				if (winner[target[b]] != bidders[b]) next.push_back(bidders[b]);
+			}
+			for (size_t k = 0; k < touched.size(); k++) {
+				int j = touched[k];
+				if (owner[j] != -1) {
+					person[owner[j]] = -1;
+					next.push_back(owner[j]);
+				}
+				owner[j] = winner[j];
+				person[winner[j]] = j;
+				price[j] = best[j];
+				winner[j] = -1;
+			}
+			sort(next.begin(), next.end());
+			bidders.swap(next);
+		}
+
+		if (eps <= final_epsilon) break;
+		eps = max(eps / AUCTION_SCALING, final_epsilon);
+	}
+	return person;
+}
+
+void auction_assignment(const cv::Mat &cost, double epsilon, int *assigned) {
+	for (int r = 0; r < cost.rows; r++) assigned[r] = -1;
+
+	// range of the entries that can be assigned
+	double lo = numeric_limits<double>::max(), hi = -numeric_limits<double>::max();
+	for (int r = 0; r < cost.rows; r++) {
+		const double *row = cost.ptr<double>(r);
+		for (int c = 0; c < cost.cols; c++) {
+			if (row[c] < INT_MAX) {
+				lo = min(lo, row[c]);
+				hi = max(hi, row[c]);
+			}
+		}
+	}
+	if (lo > hi) return;
+
+	int n = max(cost.rows, cost.cols);
+	double missing = hi + (hi - lo) + 1.;
+	vector<int> person = auction(DenseAuction(cost, n, missing), n, missing - lo, epsilon);
+
+	for (int r = 0; r < cost.rows; r++) {
+		int c = person[r];
+		if (c < cost.cols && cost.at<double>(r, c) < INT_MAX) assigned[r] = c;
+	}
+}
+
+// The sparse table is not padded but extended to a square one of rows+cols that has a perfect assignment:
+// row r may also take a column of its own (r stays unmatched), and for every column c there is a row that takes
+// c (c stays unmatched) or the own column of a row r with an entry (r,c) (r and c matched with each other).
+// Either side left unmatched costs missing/2, as in the padded table a pair costs missing; the last kind costs 0,
+// so the dummy rows never tie between their columns.
+void auction_assignment_sparse(const SPARSE_COSTS *cost, double epsilon, int *assigned) {
+	for (int r = 0; r < cost->rows; r++) assigned[r] = -1;
+
+	double lo = numeric_limits<double>::max(), hi = -numeric_limits<double>::max();
+	vector<int> entries(cost->cols, 0); // assignable entries per column
+	for (size_t k = 0; k < cost->cost.size(); k++) {
+		if (cost->cost[k] < INT_MAX) {
+			lo = min(lo, cost->cost[k]);
+			hi = max(hi, cost->cost[k]);
+			entries[cost->index[k]]++;
+		}
+	}
+	if (lo > hi) return;
+	double missing = hi + (hi - lo) + 1.;
+
+	// rows of the extended table, columns [0,cols) are the real ones, cols+r is the own column of row r
+	int n = cost->rows + cost->cols;
+	vector<int> start(n + 1, 0), index;
+	vector<double> values;
+	for (int r = 0; r < cost->rows; r++) {
+		for (int k = cost->start[r]; k < cost->start[r + 1]; k++) {
+			if (cost->cost[k] < INT_MAX) start[r + 1]++;
+		}
+		start[r + 1]++;
+	}
+	for (int c = 0; c < cost->cols; c++) start[cost->rows + c + 1] = entries[c] + 1;
+	for (int i = 0; i < n; i++) start[i + 1] += start[i];
+	index.resize(start[n]);
+	values.resize(start[n]);
+
+	vector<int> next(start.begin(), start.end() - 1);
+	for (int c = 0; c < cost->cols; c++) {
+		int i = cost->rows + c;
+		index[next[i]] = c;
+		values[next[i]++] = missing / 2;
+	}
+	for (int r = 0; r < cost->rows; r++) {
+		for (int k = cost->start[r]; k < cost->start[r + 1]; k++) {
+			if (cost->cost[k] >= INT_MAX) continue;
+			int c = cost->index[k];
+			index[next[r]] = c;
+			values[next[r]++] = cost->cost[k];
+			int i = cost->rows + c;
+			index[next[i]] = cost->cols + r;
+			values[next[i]++] = 0.;
+		}
+		index[next[r]] = cost->cols + r;
+		values[next[r]++] = missing / 2;
+	}
+
+	vector<int> person = auction(SparseAuction(start, index, values), n, missing - min(lo, 0.), epsilon);
+
+	for (int r = 0; r < cost->rows; r++) {
+		if (person[r] < cost->cols) assigned[r] = person[r];
+	}
+}
@@ -0,0 +1,173 @@
+#include <string.h>
+#include <math.h>
+#include "ps.h"
+
+// sum over all channels of the columns [j0,j1) of a 3 channel integral image between the rows top and bottom
+template<typename T> static double window_sum(const T *top, const T *bottom, int j0, int j1) {
+	double ret = 0.;
+	for (int c = 0; c < 3; c++) ret += (double)bottom[j1 * 3 + c] - bottom[j0 * 3 + c] - top[j1 * 3 + c] + top[j0 * 3 + c];
+	return ret;
+}
+
+// a CV_32S integral image wraps past INT_MAX on large images, the difference of the corners in unsigned
+// arithmetic is exact again as long as the window sums below 2^32
+static double window_sum(const int *top, const int *bottom, int j0, int j1) {
+	double ret = 0.;
+	for (int c = 0; c < 3; c++) {
+		ret += (double)((unsigned int)bottom[j1 * 3 + c] - (unsigned int)bottom[j0 * 3 + c] - (unsigned int)top[j1 * 3 + c] + (unsigned int)top[j0 * 3 + c]);
+	}
+	return ret;
+}
+
+// BRIEF: bit t tells whether the smoothed intensity at the first point of test t is below the one at the second
+static void extract_brief(
+	int height, int width, const unsigned char *img,
+	const std::vector<KEYPOINT> &points, int wsize, DESCRIPTORS *desc
+) {
+	int side = 2 * wsize + 1;
+	desc->length = desc->stride = BRIEF_BITS / 8;
+	desc->data = (unsigned char *)cv::fastMalloc((size_t)desc->count*desc->stride + 1);
+	desc->valid = (unsigned char *)cv::fastMalloc((size_t)desc->count + 1);
+	desc->cells = 0;
+	desc->coarse = (double *)cv::fastMalloc(sizeof(double));
+
+	// smoothed intensities, sigma 2 for the 48 pixel windows of the BRIEF paper
+	cv::Mat gray, smooth;
+	cv::cvtColor(cv::Mat(height, width, CV_8UC3, const_cast<unsigned char *>(img)), gray, cv::COLOR_BGR2GRAY);
+	double sigma = side / 24.;
+	cv::GaussianBlur(gray, smooth, cv::Size(), sigma > 1. ? sigma : 1.);
+
+	// the same tests for every image: offsets drawn from a gaussian with sigma side/5, clipped to the window
+	int tests[BRIEF_BITS][4];
+	cv::RNG rng(0x42524945);
+	for (int t = 0; t < BRIEF_BITS; t++) {
+		for (int e = 0; e < 4; e++) {
+			int v = cvRound(rng.gaussian(side / 5.));
+			tests[t][e] = v < -wsize ? -wsize : v > wsize ? wsize : v;
+		}
+	}
+
+	for (int k = 0; k < desc->count; k++) {
+		int i = (int)(points[k].y + 0.5);
+		int j = (int)(points[k].x + 0.5);
+		uint64_t bits[BRIEF_BITS / 64] = { 0 };
+
+		// points that are close to borders have no window
+		desc->valid[k] = i - wsize >= 0 && i + wsize <= height - 1 && j - wsize >= 0 && j + wsize <= width - 1;
+		if (desc->valid[k]) {
+			for (int t = 0; t < BRIEF_BITS; t++) {
+				if (smooth.at<unsigned char>(i + tests[t][0], j + tests[t][1]) < smooth.at<unsigned char>(i + tests[t][2], j + tests[t][3])) {
+					bits[t / 64] |= (uint64_t)1 << (t % 64);
+				}
+			}
+		}
+		memcpy(desc->data + (size_t)k*desc->stride, bits, desc->stride);
+	}
+}
+
+void extract_descriptors(
+	int height, int width, const unsigned char *img,
+	const std::vector<KEYPOINT> &points, int wsize, DESCRIPTORS *desc,
+	DESCRIPTOR_MODE mode
+) {
+	int side = 2 * wsize + 1;
+	desc->mode = mode;
+	desc->count = (int)points.size();
+	desc->wsize = wsize;
+	desc->sums = desc->norms = NULL;
+	CV_Assert(mode != DESCRIPTOR_PCA); // needs the basis, see extract_descriptor_pair()
+	if (mode == DESCRIPTOR_BRIEF) {
+		extract_brief(height, width, img, points, wsize, desc);
+		return;
+	}
+	desc->length = side*side * 3;
+	desc->stride = (desc->length + 15) / 16 * 16;
+	desc->data = (unsigned char *)cv::fastMalloc((size_t)desc->count*desc->stride + 1);
+	desc->valid = (unsigned char *)cv::fastMalloc((size_t)desc->count + 1);
+
+	// coarse grid: cell u covers the rows (columns) [side*u/grid, side*(u+1)/grid) of the patch, only for the SSD
+	int grid = side / DESCRIPTOR_CELL;
+	if (grid < 1) grid = 1;
+	if (grid > DESCRIPTOR_GRID) grid = DESCRIPTOR_GRID;
+	if (mode != DESCRIPTOR_PATCH) grid = 0;
+	desc->cells = grid*grid * 3;
+	desc->coarse = (double *)cv::fastMalloc(((size_t)desc->count*desc->cells + 1) * sizeof(double));
+
+	// NCC: sums and sums of squares of every window from integral images
+	cv::Mat sum, sqsum;
+	if (mode == DESCRIPTOR_NCC) {
+		desc->sums = (double *)cv::fastMalloc(((size_t)desc->count + 1) * sizeof(double));
+		desc->norms = (double *)cv::fastMalloc(((size_t)desc->count + 1) * sizeof(double));
+		cv::integral(cv::Mat(height, width, CV_8UC3, const_cast<unsigned char *>(img)), sum, sqsum, CV_32S, CV_64F);
+	}
+
+	for (int k = 0; k < desc->count; k++) {
+		int i = (int)(points[k].y + 0.5);
+		int j = (int)(points[k].x + 0.5);
+		unsigned char *out = desc->data + (size_t)k*desc->stride;
+		double *coarse = desc->coarse + (size_t)k*desc->cells;
+		for (int c = 0; c < desc->cells; c++) coarse[c] = 0.;
+
+		// points that are close to borders have no patch
+		desc->valid[k] = i - wsize >= 0 && i + wsize <= height - 1 && j - wsize >= 0 && j + wsize <= width - 1;
+		if (mode == DESCRIPTOR_NCC) desc->sums[k] = desc->norms[k] = 0.;
+		if (!desc->valid[k]) {
+			memset(out, 0, desc->stride);
+			continue;
+		}
+		if (mode == DESCRIPTOR_NCC) {
+			double s = window_sum(sum.ptr<int>(i - wsize), sum.ptr<int>(i + wsize + 1), j - wsize, j + wsize + 1);
+			double q = window_sum(sqsum.ptr<double>(i - wsize), sqsum.ptr<double>(i + wsize + 1), j - wsize, j + wsize + 1);
+			double var = q - s*s / desc->length;
+			desc->sums[k] = s;
+			desc->norms[k] = var > 0. ? 1. / sqrt(var) : 0.;
+		}
+
+		// the rows of the patch one after the other, then zeros up to the stride
+		for (int di = -wsize; di <= wsize; di++, out += side * 3) {
+			memcpy(out, img + ((size_t)(i + di)*width + j - wsize) * 3, side * 3);
+		}
+		memset(out, 0, desc->stride - desc->length);
+
+		// channel sums of the cells
+		const unsigned char *patch = desc->data + (size_t)k*desc->stride;
+		for (int u = 0; u < grid; u++) {
+			for (int v = 0; v < grid; v++) {
+				int sum[3] = { 0, 0, 0 };
+				for (int di = side*u / grid; di < side*(u + 1) / grid; di++) {
+					for (int dj = side*v / grid; dj < side*(v + 1) / grid; dj++) {
+						for (int c = 0; c < 3; c++) sum[c] += patch[(di*side + dj) * 3 + c];
+					}
+				}
+				int pixels = (side*(u + 1) / grid - side*u / grid) * (side*(v + 1) / grid - side*v / grid);
+				for (int c = 0; c < 3; c++) coarse[(u*grid + v) * 3 + c] = sum[c] / sqrt((double)pixels);
+			}
+		}
+	}
+}
+
+void extract_descriptor_pair(
+	int heightl, int widthl, const unsigned char *imgl,
+	int heightr, int widthr, const unsigned char *imgr,
+	const std::vector<KEYPOINT> &pointsl, const std::vector<KEYPOINT> &pointsr, int wsize,
+	DESCRIPTOR_MODE mode, DESCRIPTORS *descl, DESCRIPTORS *descr
+) {
+	if (mode == DESCRIPTOR_PCA) {
+		extract_pca_descriptors(heightl, widthl, imgl, heightr, widthr, imgr, pointsl, pointsr, wsize,
+			PCA_COMPONENTS, PCA_BASIS, descl, descr);
+		return;
+	}
+	extract_descriptors(heightl, widthl, imgl, pointsl, wsize, descl, mode);
+	extract_descriptors(heightr, widthr, imgr, pointsr, wsize, descr, mode);
+}
+
+void free_descriptors(DESCRIPTORS *desc) {
+	cv::fastFree(desc->data);
+	cv::fastFree(desc->valid);
+	cv::fastFree(desc->coarse);
+	cv::fastFree(desc->sums);
+	cv::fastFree(desc->norms);
+	desc->data = desc->valid = NULL;
+	desc->coarse = desc->sums = desc->norms = NULL;
+	desc->count = 0;
+}
@@ -0,0 +1,124 @@
+// guided matching: the right keypoints are bucketed into a uniform grid, every left keypoint is only compared
+// with the right keypoints around its position predicted by a global shift or a homography from a first pass
+#include <math.h>
+#include <algorithm>
+using namespace std;
+
+#include <opencv2/calib3d/calib3d.hpp>
+
+#include "ps.h"
+
+void build_keypoint_grid(const vector<KEYPOINT> &points, double cell, KEYPOINT_GRID *grid) {
+	grid->cell = cell > 1. ? cell : 1.;
+	grid->x0 = grid->y0 = 0.;
+	double x1 = 0., y1 = 0.;
+	for (size_t k = 0; k < points.size(); k++) {
+		if (k == 0 || points[k].x < grid->x0) grid->x0 = points[k].x;
+		if (k == 0 || points[k].y < grid->y0) grid->y0 = points[k].y;
+		if (k == 0 || points[k].x > x1) x1 = points[k].x;
+		if (k == 0 || points[k].y > y1) y1 = points[k].y;
+	}
+	grid->cols = (int)((x1 - grid->x0) / grid->cell) + 1;
+	grid->rows = (int)((y1 - grid->y0) / grid->cell) + 1;
+
+	// counting sort by cell, every cell keeps its keypoints in ascending order
+	grid->start.assign((size_t)grid->rows*grid->cols + 1, 0);
+	grid->index.resize(points.size());
+	vector<int> cells(points.size());
+	for (size_t k = 0; k < points.size(); k++) {
+		int u = (int)((points[k].y - grid->y0) / grid->cell);
+		int v = (int)((points[k].x - grid->x0) / grid->cell);
+		cells[k] = u*grid->cols + v;
+		grid->start[cells[k] + 1]++;
+	}
+	for (size_t c = 1; c < grid->start.size(); c++) grid->start[c] += grid->start[c - 1];
+	vector<int> next(grid->start.begin(), grid->start.end() - 1);
+	for (size_t k = 0; k < points.size(); k++) grid->index[next[cells[k]]++] = (int)k;
+}
+
+void query_keypoint_grid(
+	const KEYPOINT_GRID *grid, const vector<KEYPOINT> &points,
+	double x, double y, double radius, vector<int> &candidates
+) {
+	candidates.clear();
+	double u0 = floor((y - radius - grid->y0) / grid->cell);
+	double u1 = floor((y + radius - grid->y0) / grid->cell);
+	double v0 = floor((x - radius - grid->x0) / grid->cell);
+	double v1 = floor((x + radius - grid->x0) / grid->cell);
+	if (!(u1 >= 0. && v1 >= 0. && u0 < grid->rows && v0 < grid->cols)) return; // also catches NaN
+	int ua = u0 > 0. ? (int)u0 : 0;
+	int ub = u1 < grid->rows - 1 ? (int)u1 : grid->rows - 1;
+	int va = v0 > 0. ? (int)v0 : 0;
+	int vb = v1 < grid->cols - 1 ? (int)v1 : grid->cols - 1;
+
+	for (int u = ua; u <= ub; u++) {
+		for (int c = u*grid->cols + va; c <= u*grid->cols + vb; c++) {
+			for (int k = grid->start[c]; k < grid->start[c + 1]; k++) {
+				int ir = grid->index[k];
+				double dx = points[ir].x - x;
+				double dy = points[ir].y - y;
+				if (dx*dx + dy*dy <= radius*radius) candidates.push_back(ir);
+			}
+		}
+	}
+	// in the order of a full scan, so ties end up as without the guide
+	sort(candidates.begin(), candidates.end());
+}
+
+// matches that land within the radius of their prediction
+static int guide_inliers(const GUIDE *guide, const vector<MATCH> &matches) {
+	int ret = 0;
+	for (size_t k = 0; k < matches.size(); k++) {
+		double x, y;
+		if (!guide_predict(guide, matches[k].xl, matches[k].yl, &x, &y)) continue;
+		double dx = matches[k].xr - x;
+		double dy = matches[k].yr - y;
+		if (dx*dx + dy*dy <= guide->radius*guide->radius) ret++;
+	}
+	return ret;
+}
+
+bool guide_from_matches(const vector<MATCH> &matches, double radius, GUIDE *guide) {
+	if (matches.empty()) return false;
+
+	// median shift
+	vector<double> dx, dy;
+	for (size_t k = 0; k < matches.size(); k++) {
+		dx.push_back(matches[k].xr - matches[k].xl);
+		dy.push_back(matches[k].yr - matches[k].yl);
+	}
+	nth_element(dx.begin(), dx.begin() + dx.size() / 2, dx.end());
+	nth_element(dy.begin(), dy.begin() + dy.size() / 2, dy.end());
+	double shift[9] = { 1., 0., dx[dx.size() / 2], 0., 1., dy[dy.size() / 2], 0., 0., 1. };
+	copy(shift, shift + 9, guide->H);
+	guide->radius = radius;
+	if (matches.size() < GUIDE_MIN_HOMOGRAPHY) return true;
+
+	// homography, if it explains more of the matches than the shift
+	vector<cv::Point2d> v1, v2;
+	for (size_t k = 0; k < matches.size(); k++) {
+		v1.push_back(cv::Point2d(matches[k].xl, matches[k].yl));
+		v2.push_back(cv::Point2d(matches[k].xr, matches[k].yr));
+	}
+	cv::Mat H = cv::findHomography(v1, v2, CV_RANSAC);
+	if (H.rows != 3 || H.cols != 3) return true;
+	GUIDE homography;
+	for (int i = 0; i < 9; i++) homography.H[i] = H.at<double>(i / 3, i % 3);
+	homography.radius = radius;
+	if (guide_inliers(&homography, matches) > guide_inliers(guide, matches)) *guide = homography;
+	return true;
+}
+
+bool estimate_guide(
+	int heightl, int widthl, unsigned char *imgl,
+	int heightr, int widthr, unsigned char *imgr,
+	const vector<KEYPOINT> &pointsl, const vector<KEYPOINT> &pointsr, int wsize,
+	int samples, double radius, GUIDE *guide
+) {
+	// a full first pass on every step-th left keypoint
+	int step = samples > 0 && (int)pointsl.size() > samples ? (int)pointsl.size() / samples : 1;
+	vector<KEYPOINT> subset;
+	for (size_t k = 0; k < pointsl.size(); k += step) subset.push_back(pointsl[k]);
+	vector<MATCH> matches = matching(heightl, widthl, imgl, heightr, widthr, imgr, subset, pointsr, wsize);
+	return guide_from_matches(matches, radius, guide);
+}
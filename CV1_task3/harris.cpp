@@ -3,14 +3,89 @@
 using namespace std;
 #include "ps.h"
 
+// Squared color gradients of the row between r0 and r2, for every interleaved element k = 3*j + channel
+// with 1 <= j < width-1. All three channels are handled at once, no deinterleaving needed:
+// the column sums (sum) and differences (diff) of the three rows come first,
+// vertical gradient -> sqv[k] = (sum[k+3] - sum[k-3])^2
+// horizontal gradient -> sqh[k] = (diff[k-3] + diff[k] + diff[k+3])^2
+// The gradients lie in [-765, 765], so 16 bits per element are enough and the squares are exact.
+static void color_gradients_row(
+	int width, const unsigned char *r0, const unsigned char *r1, const unsigned char *r2,
+	short *sum, short *diff, int *sqh, int *sqv
+) {
+	const int n = 3 * width;
+	int k = 0;
+
+#ifdef PS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; k + 16 <= n; k += 16) {
+		__m128i p0 = _mm_loadu_si128((const __m128i *)(r0 + k));
+		__m128i p1 = _mm_loadu_si128((const __m128i *)(r1 + k));
+		__m128i p2 = _mm_loadu_si128((const __m128i *)(r2 + k));
+		__m128i lo0 = _mm_unpacklo_epi8(p0, zero), hi0 = _mm_unpackhi_epi8(p0, zero);
+		__m128i lo1 = _mm_unpacklo_epi8(p1, zero), hi1 = _mm_unpackhi_epi8(p1, zero);
+		__m128i lo2 = _mm_unpacklo_epi8(p2, zero), hi2 = _mm_unpackhi_epi8(p2, zero);
+		_mm_storeu_si128((__m128i *)(sum + k), _mm_add_epi16(_mm_add_epi16(lo0, lo1), lo2));
+		_mm_storeu_si128((__m128i *)(sum + k + 8), _mm_add_epi16(_mm_add_epi16(hi0, hi1), hi2));
+		_mm_storeu_si128((__m128i *)(diff + k), _mm_sub_epi16(lo2, lo0));
+		_mm_storeu_si128((__m128i *)(diff + k + 8), _mm_sub_epi16(hi2, hi0));
+	}
+#endif
+	for (; k < n; k++) {
+		sum[k] = (short)(r0[k] + r1[k] + r2[k]);
+		diff[k] = (short)(r2[k] - r0[k]);
+	}
+
+	k = 3;
+#ifdef PS_SSE2
+	for (; k + 11 <= n; k += 8) {
+		__m128i gv = _mm_sub_epi16(
+			_mm_loadu_si128((const __m128i *)(sum + k + 3)),
+			_mm_loadu_si128((const __m128i *)(sum + k - 3)));
+		__m128i gh = _mm_add_epi16(_mm_add_epi16(
+			_mm_loadu_si128((const __m128i *)(diff + k - 3)),
+			_mm_loadu_si128((const __m128i *)(diff + k))),
+			_mm_loadu_si128((const __m128i *)(diff + k + 3)));
+		// (g, 0) pairs, madd gives g*g + 0*0 in 32 bits
+		__m128i v = _mm_unpacklo_epi16(gv, zero);
+		_mm_storeu_si128((__m128i *)(sqv + k), _mm_madd_epi16(v, v));
+		v = _mm_unpackhi_epi16(gv, zero);
+		_mm_storeu_si128((__m128i *)(sqv + k + 4), _mm_madd_epi16(v, v));
+		v = _mm_unpacklo_epi16(gh, zero);
+		_mm_storeu_si128((__m128i *)(sqh + k), _mm_madd_epi16(v, v));
+		v = _mm_unpackhi_epi16(gh, zero);
+		_mm_storeu_si128((__m128i *)(sqh + k + 4), _mm_madd_epi16(v, v));
+	}
+#endif
+	for (; k < n - 3; k++) {
+		int gv = sum[k + 3] - sum[k - 3];
+		int gh = diff[k - 3] + diff[k] + diff[k + 3];
+		sqv[k] = gv*gv;
+		sqh[k] = gh*gh;
+	}
+}
+
+// a, b, c and e, plus the larger of the gradient rows, mean_filter() and local_maxima()
+size_t harris_workspace(int height, int width, int wsize_loc) {
+	size_t rows = 2 * ARENA_SIZE(short, 3 * width) + 2 * ARENA_SIZE(int, 3 * width);
+	size_t filters = mean_filter_workspace(height, width);
+	if (local_maxima_workspace(height, width, wsize_loc) > filters) filters = local_maxima_workspace(height, width, wsize_loc);
+	return 4 * ARENA_SIZE(double, height*width) + (rows > filters ? rows : filters);
+}
+
 vector<KEYPOINT> harris(
 	int height, int width, unsigned char *img,
-	int wsize_sum, int wsize_local_maxima, const char *name
+	int wsize_sum, int wsize_local_maxima, const char *name, ARENA *arena
 ) {
+	ARENA local = ARENA();
+	arena = arena_or_local(arena, &local, harris_workspace(height, width, wsize_local_maxima));
+	size_t mark = arena_mark(arena);
+
 	// compute a,b and c coeffitients
-	double *a = new double[height*width];
-	double *b = new double[height*width];
-	double *c = new double[height*width];
+	double *a = ARENA_ALLOC(arena, double, height*width);
+	double *b = ARENA_ALLOC(arena, double, height*width);
+	double *c = ARENA_ALLOC(arena, double, height*width);
+	double *e = ARENA_ALLOC(arena, double, height*width);
 
 	// zero borders (no gradients -> no detection)
 	for (int i = 0; i < height; i++) {
@@ -22,57 +97,70 @@ vector<KEYPOINT> harris(
 			a[width*(height - 1) + j] = b[width*(height - 1) + j] = c[width*(height - 1) + j] = 0.;
 	}
 
-	// loop over inside
+	// loop over inside, row by row
+	size_t rows = arena_mark(arena);
+	short *colsum = ARENA_ALLOC(arena, short, 3 * width);
+	short *coldiff = ARENA_ALLOC(arena, short, 3 * width);
+	int *sqh = ARENA_ALLOC(arena, int, 3 * width);
+	int *sqv = ARENA_ALLOC(arena, int, 3 * width);
 	for (int i = 1; i < height - 1; i++) {
-		for (int j = 1; j < width - 1; j++) {
-			// vertical gradient
-			double rgrad =
-				(double)img[INDEX(i - 1, j + 1, 0)] + img[INDEX(i, j + 1, 0)] + img[INDEX(i + 1, j + 1, 0)] -
-				img[INDEX(i - 1, j - 1, 0)] - img[INDEX(i, j - 1, 0)] - img[INDEX(i + 1, j - 1, 0)];
-			double ggrad =
-				(double)img[INDEX(i - 1, j + 1, 1)] + img[INDEX(i, j + 1, 1)] + img[INDEX(i + 1, j + 1, 1)] -
-				img[INDEX(i - 1, j - 1, 1)] - img[INDEX(i, j - 1, 1)] - img[INDEX(i + 1, j - 1, 1)];
-			double bgrad =
-				(double)img[INDEX(i - 1, j + 1, 2)] + img[INDEX(i, j + 1, 2)] + img[INDEX(i + 1, j + 1, 2)] -
-				img[INDEX(i - 1, j - 1, 2)] - img[INDEX(i, j - 1, 2)] - img[INDEX(i + 1, j - 1, 2)];
-			double vgrad = sqrt(rgrad*rgrad + ggrad*ggrad + bgrad*bgrad);
-			// horizontal gradient
-			rgrad =
-				(double)img[INDEX(i + 1, j - 1, 0)] + img[INDEX(i + 1, j, 0)] + img[INDEX(i + 1, j + 1, 0)] -
-				img[INDEX(i - 1, j - 1, 0)] - img[INDEX(i - 1, j, 0)] - img[INDEX(i - 1, j + 1, 0)];
-			ggrad =
-				(double)img[INDEX(i + 1, j - 1, 1)] + img[INDEX(i + 1, j, 1)] + img[INDEX(i + 1, j + 1, 1)] -
-				img[INDEX(i - 1, j - 1, 1)] - img[INDEX(i - 1, j, 1)] - img[INDEX(i - 1, j + 1, 1)];
-			bgrad =
-				(double)img[INDEX(i + 1, j - 1, 2)] + img[INDEX(i + 1, j, 2)] + img[INDEX(i + 1, j + 1, 2)] -
-				img[INDEX(i - 1, j - 1, 2)] - img[INDEX(i - 1, j, 2)] - img[INDEX(i - 1, j + 1, 2)];
-			double hgrad = sqrt(rgrad*rgrad + ggrad*ggrad + bgrad*bgrad);
-
-			a[i*width + j] = hgrad*hgrad;
-			b[i*width + j] = hgrad*vgrad;
-			c[i*width + j] = vgrad*vgrad;
+		color_gradients_row(width, img + 3 * (i - 1)*width, img + 3 * i*width, img + 3 * (i + 1)*width, colsum, coldiff, sqh, sqv);
+
+		double *ai = a + i*width;
+		double *bi = b + i*width;
+		double *ci = c + i*width;
+		int j = 1;
+#ifdef PS_SSE2
+		for (; j + 1 < width - 1; j += 2) {
+			const int *h = sqh + 3 * j;
+			const int *v = sqv + 3 * j;
+			__m128d hgrad = _mm_sqrt_pd(_mm_set_pd(h[3] + h[4] + h[5], h[0] + h[1] + h[2]));
+			__m128d vgrad = _mm_sqrt_pd(_mm_set_pd(v[3] + v[4] + v[5], v[0] + v[1] + v[2]));
+			_mm_storeu_pd(ai + j, _mm_mul_pd(hgrad, hgrad));
+			_mm_storeu_pd(bi + j, _mm_mul_pd(hgrad, vgrad));
+			_mm_storeu_pd(ci + j, _mm_mul_pd(vgrad, vgrad));
+		}
+#endif
+		for (; j < width - 1; j++) {
+			const int *h = sqh + 3 * j;
+			const int *v = sqv + 3 * j;
+			double hgrad = sqrt((double)(h[0] + h[1] + h[2]));
+			double vgrad = sqrt((double)(v[0] + v[1] + v[2]));
+			ai[j] = hgrad*hgrad;
+			bi[j] = hgrad*vgrad;
+			ci[j] = vgrad*vgrad;
 		}
 	}
+	arena_release(arena, rows);
 
 #ifdef SAVE_ALL
 	save_double_as_image(height, width, a, (string("a") + string(name) + string(".png")).c_str());
 	save_double_as_image(height, width, b, (string("b") + string(name) + string(".png")).c_str());
 	save_double_as_image(height, width, c, (string("c") + string(name) + string(".png")).c_str());
 #endif
+#ifdef SAVE_RAW
+	save_double_as_plane(height, width, a, (string("a") + string(name) + string(".plane")).c_str());
+	save_double_as_plane(height, width, b, (string("b") + string(name) + string(".plane")).c_str());
+	save_double_as_plane(height, width, c, (string("c") + string(name) + string(".plane")).c_str());
+#endif
 
 	// a, b, c are computed, integrate now
-	mean_filter(height, width, a, wsize_sum);
-	mean_filter(height, width, b, wsize_sum);
-	mean_filter(height, width, c, wsize_sum);
+	mean_filter(height, width, a, wsize_sum, arena);
+	mean_filter(height, width, b, wsize_sum, arena);
+	mean_filter(height, width, c, wsize_sum, arena);
 
 #ifdef SAVE_ALL
 	save_double_as_image(height, width, a, (string("aa") + string(name) + string(".png")).c_str());
 	save_double_as_image(height, width, b, (string("bb") + string(name) + string(".png")).c_str());
 	save_double_as_image(height, width, c, (string("cc") + string(name) + string(".png")).c_str());
 #endif
+#ifdef SAVE_RAW
+	save_double_as_plane(height, width, a, (string("aa") + string(name) + string(".plane")).c_str());
+	save_double_as_plane(height, width, b, (string("bb") + string(name) + string(".plane")).c_str());
+	save_double_as_plane(height, width, c, (string("cc") + string(name) + string(".plane")).c_str());
+#endif
 
 	// cornerness
-	double *e = new double[height*width];
 	for (int i = 0; i < height; i++) {
 		for (int j = 0; j < width; j++) {
 			e[i*width + j] = a[i*width + j] * c[i*width + j] - b[i*width + j] * b[i*width + j]
@@ -83,8 +171,11 @@ vector<KEYPOINT> harris(
 #ifdef SAVE_ALL
 	save_double_as_image(height, width, e, (string("e") + string(name) + string(".png")).c_str());
 #endif
+#ifdef SAVE_RAW
+	save_double_as_plane(height, width, e, (string("e") + string(name) + string(".plane")).c_str());
+#endif
 
-	vector<KEYPOINT> points = local_maxima(height, width, e, wsize_local_maxima, name);
+	vector<KEYPOINT> points = local_maxima(height, width, e, wsize_local_maxima, name, arena);
 
 	// filter out the "obviously bad" ones -- those with the quality less than the mean
 	double sum = 0;
@@ -97,10 +188,8 @@ vector<KEYPOINT> harris(
 	}
 
 	// free memory
-	delete[] a;
-	delete[] b;
-	delete[] c;
-	delete[] e;
+	arena_release(arena, mark);
+	arena_free(&local);
 
 	return ret;
 }
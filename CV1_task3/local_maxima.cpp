@@ -1,82 +1,226 @@
 #include <stdio.h>
+#include <float.h>
 #include <iostream>
-#include <set>
+#include <algorithm>
 using namespace std;
 #include "ps.h"
 
-vector<KEYPOINT> local_maxima(int height, int width, double *e, int wsize, const char *name) {
-	// separable maximum filter
-	double *tmp1 = new double[height*width];
-	double *tmp2 = new double[height*width];
-	// horizontal
-	for (int i = 0; i < height; i++) {
-		multiset<double> set;
-		set.clear();
-		// prefill the multiset
-		for (int j = 0; j < wsize; j++) set.insert(e[i*width + j]);
-		// left border
-		for (int j = 0; j < wsize + 1; j++) {
-			set.insert(e[i*width + j + wsize]);
-			tmp1[i*width + j] = *(set.rbegin());
-		}
-		// inside
-		for (int j = wsize + 1; j < width - wsize; j++) {
-			set.erase(set.find(e[i*width + j - wsize - 1]));
-			set.insert(e[i*width + j + wsize]);
-			tmp1[i*width + j] = *(set.rbegin());
+// Separable maximum filter after van Herk/Gil-Werman: the line, padded with -DBL_MAX by wsize on both sides,
+// is cut into blocks of k = 2*wsize+1. G holds the running maximum from the start of each block, H the one
+// from its end. The maximum of the window [p, p+k) is max(H[p], G[p+k-1]) -- about three comparisons per
+// element whatever the window size. The padding clips the windows at the image borders.
+
+// row bands of the horizontal pass, each one has its own G and H lines
+#define LOCAL_MAXIMA_BANDS 8
+
+// columns of one strip of the vertical pass, two doubles per SSE2 register
+#define LOCAL_MAXIMA_STRIP 256
+
+// padded and block aligned length of a line
+static int padded_length(int n, int wsize) {
+	int k = 2 * wsize + 1;
+	return (n + 2 * wsize + k - 1) / k * k;
+}
+
+// horizontal pass: tmp1 = maximum of every row window
+class MaxRowsBody : public cv::ParallelLoopBody {
+public:
+	MaxRowsBody(int height, int width, const double *e, double *tmp1, double *lines, int wsize)
+		: height(height), width(width), e(e), tmp1(tmp1), lines(lines), wsize(wsize) {}
+
+	void operator()(const cv::Range &range) const {
+		const int k = 2 * wsize + 1;
+		const int len = padded_length(width, wsize);
+
+		for (int band = range.start; band < range.end; band++) {
+			double *G = lines + (size_t)band * 2 * len;
+			double *H = G + len;
+
+			for (int i = height*band / LOCAL_MAXIMA_BANDS; i < height*(band + 1) / LOCAL_MAXIMA_BANDS; i++) {
+				const double *src = e + (size_t)i*width; // padded position p is src[p - wsize]
+				double *dst = tmp1 + (size_t)i*width;
+
+				for (int p0 = 0; p0 < len; p0 += k) {
+					G[p0] = value(src, p0);
+					for (int p = p0 + 1; p < p0 + k; p++) G[p] = max(G[p - 1], value(src, p));
+					H[p0 + k - 1] = value(src, p0 + k - 1);
+					for (int p = p0 + k - 2; p >= p0; p--) H[p] = max(H[p + 1], value(src, p));
+				}
+				// the window of column j starts at padded position j
+				for (int j = 0; j < width; j++) dst[j] = j % k == 0 ? H[j] : max(H[j], G[j + k - 1]);
+			}
 		}
-		// right border
-		for (int j = width - wsize; j < width; j++) {
-			set.erase(set.find(e[i*width + j - wsize - 1]));
-			tmp1[i*width + j] = *(set.rbegin());
+	}
+
+private:
+	double value(const double *src, int p) const {
+		return p < wsize || p >= width + wsize ? -DBL_MAX : src[p - wsize];
+	}
+
+	int height;
+	int width;
+	const double *e;
+	double *tmp1;
+	double *lines;
+	int wsize;
+};
+
+// vertical pass on whole rows of a column strip, the same blocks along the columns;
+// every finished maximum row is compared against e right away, tmp2 only exists for SAVE_ALL
+class MaxColsBody : public cv::ParallelLoopBody {
+public:
+	MaxColsBody(int height, int width, const double *e, const double *tmp1, double *rows, double *tmp2, int wsize,
+		vector<vector<KEYPOINT> > &points)
+		: height(height), width(width), e(e), tmp1(tmp1), rows(rows), tmp2(tmp2), wsize(wsize), points(points) {}
+
+	void operator()(const cv::Range &range) const {
+		const int k = 2 * wsize + 1;
+
+		for (int s = range.start; s < range.end; s++) {
+			int j0 = s*LOCAL_MAXIMA_STRIP;
+			int j1 = j0 + LOCAL_MAXIMA_STRIP < width ? j0 + LOCAL_MAXIMA_STRIP : width;
+			vector<KEYPOINT> &ret = points[s];
+
+			// block B covers the padded rows [B*k, B*k+k) and gives the results of the rows i = B*k ... B*k+k-1,
+			// whose windows end in block B+1
+			for (int p0 = 0; p0 < height; p0 += k) {
+				// H of block B, backwards
+				for (int r = k - 1; r >= 0; r--) {
+					double *H = row(r);
+					const double *src = source(p0 + r - wsize);
+					if (r == k - 1) set(H, src, j0, j1);
+					else maximum(H, row(r + 1), src, j0, j1);
+				}
+				// G of block B+1, forwards
+				for (int r = 0; r < k; r++) {
+					double *G = row(k + r);
+					const double *src = source(p0 + k + r - wsize);
+					if (r == 0) set(G, src, j0, j1);
+					else maximum(G, row(k + r - 1), src, j0, j1);
+				}
+				for (int r = 0; r < k && p0 + r < height; r++) {
+					int i = p0 + r;
+					double *m = row(r);
+					if (r > 0) maximum(m, m, row(k + r - 1), j0, j1);
+#ifdef SAVE_ALL
+					for (int j = j0; j < j1; j++) tmp2[(size_t)i*width + j] = m[j];
+#endif
+					if (i >= wsize + 2 && i < height - wsize - 2) candidates(i, m, j0, j1, ret);
+				}
+			}
 		}
 	}
-	// vertical
-	for (int j = 0; j < width; j++) {
-		multiset<double> set;
-		set.clear();
-		// prefill the multiset
-		for (int i = 0; i < wsize; i++) set.insert(tmp1[i*width + j]);
-		// top border
-		for (int i = 0; i < wsize + 1; i++) {
-			set.insert(tmp1[(i + wsize)*width + j]);
-			tmp2[i*width + j] = *(set.rbegin());
+
+private:
+	double *row(int r) const {
+		return rows + (size_t)r*width;
+	}
+
+	// image row x or NULL for the padding
+	const double *source(int x) const {
+		return x < 0 || x >= height ? NULL : tmp1 + (size_t)x*width;
+	}
+
+	static void set(double *dst, const double *src, int j0, int j1) {
+		for (int j = j0; j < j1; j++) dst[j] = src ? src[j] : -DBL_MAX;
+	}
+
+	// dst = max(a, b), b == NULL is the padding
+	static void maximum(double *dst, const double *a, const double *b, int j0, int j1) {
+		if (b == NULL) {
+			if (dst != a) for (int j = j0; j < j1; j++) dst[j] = a[j];
+			return;
 		}
-		// inside
-		for (int i = wsize + 1; i < height - wsize; i++) {
-			set.erase(set.find(tmp1[(i - wsize - 1)*width + j]));
-			set.insert(tmp1[(i + wsize)*width + j]);
-			tmp2[i*width + j] = *(set.rbegin());
+		int j = j0;
+#ifdef PS_SSE2
+		for (; j + 2 <= j1; j += 2) _mm_storeu_pd(dst + j, _mm_max_pd(_mm_loadu_pd(a + j), _mm_loadu_pd(b + j)));
+#endif
+		for (; j < j1; j++) dst[j] = max(a[j], b[j]);
+	}
+
+	// e == maximum of its window -> local maximum
+	void candidates(int i, const double *m, int j0, int j1, vector<KEYPOINT> &ret) const {
+		const double *ei = e + (size_t)i*width;
+		int lo = j0 > wsize + 2 ? j0 : wsize + 2;
+		int hi = j1 < width - wsize - 2 ? j1 : width - wsize - 2;
+		int j = lo;
+#ifdef PS_SSE2
+		for (; j + 2 <= hi; j += 2) {
+			int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(ei + j), _mm_loadu_pd(m + j)));
+			if (mask & 1) push(ret, j, i, m[j]);
+			if (mask & 2) push(ret, j + 1, i, m[j + 1]);
 		}
-		// bottom border
-		for (int i = height - wsize; i < height; i++) {
-			set.erase(set.find(tmp1[(i - wsize - 1)*width + j]));
-			tmp2[i*width + j] = *(set.rbegin());
+#endif
+		for (; j < hi; j++) {
+			if (ei[j] == m[j]) push(ret, j, i, m[j]);
 		}
 	}
 
+	static void push(vector<KEYPOINT> &ret, int x, int y, double value) {
+		KEYPOINT point;
+		point.x = x;
+		point.y = y;
+		point.value = value;
+		ret.push_back(point);
+	}
+
+	int height;
+	int width;
+	const double *e;
+	const double *tmp1;
+	double *rows; // 2k rows: H of the current block, G of the next one
+	double *tmp2;
+	int wsize;
+	vector<vector<KEYPOINT> > &points;
+};
+
+size_t local_maxima_workspace(int height, int width, int wsize) {
+	size_t lines = LOCAL_MAXIMA_BANDS * ARENA_SIZE(double, 2 * padded_length(width, wsize));
+	size_t rows = ARENA_SIZE(double, 2 * (2 * wsize + 1)*width);
+	size_t ret = ARENA_SIZE(double, height*width) + (lines > rows ? lines : rows);
+#ifdef SAVE_ALL
+	ret += ARENA_SIZE(double, height*width);
+#endif
+	return ret;
+}
+
+vector<KEYPOINT> local_maxima(int height, int width, double *e, int wsize, const char *name, ARENA *arena) {
+	ARENA local = ARENA();
+	arena = arena_or_local(arena, &local, local_maxima_workspace(height, width, wsize));
+	size_t mark = arena_mark(arena);
+
+	double *tmp1 = ARENA_ALLOC(arena, double, height*width);
+	double *tmp2 = NULL;
+#ifdef SAVE_ALL
+	tmp2 = ARENA_ALLOC(arena, double, height*width);
+#endif
+
+	// horizontal
+	size_t lines = arena_mark(arena);
+	cv::parallel_for_(cv::Range(0, LOCAL_MAXIMA_BANDS),
+		MaxRowsBody(height, width, e, tmp1, ARENA_ALLOC(arena, double, LOCAL_MAXIMA_BANDS * 2 * padded_length(width, wsize)), wsize));
+	arena_release(arena, lines);
+
+	// vertical and find local maxima
+	int strips = (width + LOCAL_MAXIMA_STRIP - 1) / LOCAL_MAXIMA_STRIP;
+	vector<vector<KEYPOINT> > points(strips);
+	cv::parallel_for_(cv::Range(0, strips),
+		MaxColsBody(height, width, e, tmp1, ARENA_ALLOC(arena, double, 2 * (2 * wsize + 1)*width), tmp2, wsize, points));
+
 #ifdef SAVE_ALL
 	save_double_as_image(height, width, tmp2, (string("m") + string(name) + string(".png")).c_str());
 #endif
 
-	// find local maxima
+	// row by row like a scan of the whole image
 	vector<KEYPOINT> ret;
 	ret.clear();
+	for (int s = 0; s < strips; s++) ret.insert(ret.end(), points[s].begin(), points[s].end());
+	sort(ret.begin(), ret.end(), [](const KEYPOINT &p, const KEYPOINT &q) {
+		return p.y < q.y || (p.y == q.y && p.x < q.x);
+	});
 
-	for (int i = wsize + 2; i < height - wsize - 2; i++) {
-		for (int j = wsize + 2; j < width - wsize - 2; j++) {
-			if (e[i*width + j] == tmp2[i*width + j]) {
-				KEYPOINT point;
-				point.x = j;
-				point.y = i;
-				point.value = tmp2[i*width + j];
-				ret.push_back(point);
-			}
-		}
-	}
-
-	delete[] tmp1;
-	delete[] tmp2;
+	arena_release(arena, mark);
+	arena_free(&local);
 
 	return ret;
 }
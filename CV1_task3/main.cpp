@@ -58,18 +58,40 @@ int main(int argc, char** argv) {
 
 	// Harris detector
 	std::cout << "Start Harris detector ..." << std::endl;
-	//std::vector<KEYPOINT> pointsl = harris(heightl, widthl, imgl.ptr(0), wsize_sum, wsize_local_maxima, "L");
-	std::vector<KEYPOINT> pointsl = HarrisDetector(imgl).filterKeyPoints(greaterThan(100000));
+	//ARENA arena = ARENA(); // scratch memory of harris(), sized once for the larger image
+	//arena_reserve(&arena, std::max(harris_workspace(heightl, widthl, wsize_local_maxima), harris_workspace(heightr, widthr, wsize_local_maxima)));
+	//std::vector<KEYPOINT> pointsl = harris(heightl, widthl, imgl.ptr(0), wsize_sum, wsize_local_maxima, "L", &arena);
+	HarrisDetector harrisl(imgl);
+	std::vector<KEYPOINT> pointsl = harrisl.filterKeyPoints(greaterThan(100000));
+#ifdef SAVE_RAW
+	harrisl.savePlanes("L");
+#endif
 	std::cout << pointsl.size() << " keypoints in the left image" << std::endl;
 
-	//std::vector<KEYPOINT> pointsr = harris(heightr, widthr, imgr.ptr(0), wsize_sum, wsize_local_maxima, "R");
-	std::vector<KEYPOINT> pointsr = HarrisDetector(imgr).filterKeyPoints(greaterThan(100000));
+	//std::vector<KEYPOINT> pointsr = harris(heightr, widthr, imgr.ptr(0), wsize_sum, wsize_local_maxima, "R", &arena);
+	//arena_free(&arena);
+	HarrisDetector harrisr(imgr);
+	std::vector<KEYPOINT> pointsr = harrisr.filterKeyPoints(greaterThan(100000));
+#ifdef SAVE_RAW
+	harrisr.savePlanes("R");
+#endif
 	std::cout << pointsr.size() << " keypoints in the right image" << std::endl;
 
 
 	// Matching
 	std::cout << "Start matching ..." << std::endl;
-	std::vector<MATCH> matches = Matching(imgl, imgr, pointsl, pointsr, wsize_match).getMatches();
+#if defined(ANN_MATCHING)
+	std::vector<MATCH> matches = matching_ann(heightl, widthl, imgl.ptr(0), heightr, widthr, imgr.ptr(0), pointsl, pointsr, wsize_match, 4, 128);
+#elif defined(GUIDED_MATCHING)
+	// first pass on a few hundred left keypoints, then only look around the predicted positions
+	GUIDE guide;
+	bool guided = estimate_guide(heightl, widthl, imgl.ptr(0), heightr, widthr, imgr.ptr(0), pointsl, pointsr, wsize_match,
+		200, (widthr + heightr) / 40., &guide);
+	std::cout << (guided ? "Guided" : "No guide,") << " matching" << std::endl;
+	std::vector<MATCH> matches = Matching(imgl, imgr, pointsl, pointsr, wsize_match, guided ? &guide : NULL, MATCHING_DESCRIPTOR, MATCHING_ASSIGNMENT, AUCTION_EPSILON, MATCHING_CANDIDATES).getMatches();
+#else
+	std::vector<MATCH> matches = Matching(imgl, imgr, pointsl, pointsr, wsize_match, NULL, MATCHING_DESCRIPTOR, MATCHING_ASSIGNMENT, AUCTION_EPSILON, MATCHING_CANDIDATES).getMatches();
+#endif
 	//std::vector<MATCH> matches = matching(heightl, widthl, imgl.ptr(0), heightr, widthr, imgr.ptr(0), pointsl, pointsr, wsize_match);
 	std::cout << matches.size() << " matching pairs found" << std::endl;
 	#ifdef SAVE_ALL
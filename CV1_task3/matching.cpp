@@ -1,86 +1,180 @@
 #include <iostream>
+#include <climits>
+#include <algorithm>
 using namespace std;
 #include "ps.h"
 
-double quality(
-	int heightl, int widthl, unsigned char *imgl, int il, int jl,
-	int heightr, int widthr, unsigned char *imgr, int ir, int jr,
-	int wsize
-) {
-	// filter out points that are close to borders
-	if (il - wsize < 0) return numeric_limits<double>::max();
-	if (ir - wsize < 0) return numeric_limits<double>::max();
-	if (il + wsize > heightl - 1) return numeric_limits<double>::max();
-	if (ir + wsize > heightr - 1) return numeric_limits<double>::max();
-	if (jl - wsize < 0) return numeric_limits<double>::max();
-	if (jr - wsize < 0) return numeric_limits<double>::max();
-	if (jl + wsize > widthl - 1) return numeric_limits<double>::max();
-	if (jr + wsize > widthr - 1) return numeric_limits<double>::max();
-
-	double q = 0.;
-	for (int di = -wsize; di <= wsize; di++) {
-		for (int dj = -wsize; dj <= wsize; dj++) {
-			int indexl = ((il + di)*widthl + jl + dj) * 3;
-			int indexr = ((ir + di)*widthr + jr + dj) * 3;
-			double dr = (double)imgl[indexl] - (double)imgr[indexr];
-			double dg = (double)imgl[indexl + 1] - (double)imgr[indexr + 1];
-			double db = (double)imgl[indexl + 2] - (double)imgr[indexr + 2];
-			q += dr*dr + dg*dg + db*db;
+// The nl x nr pairs are cut into tiles of MATCHING_BLOCK left and MATCHING_BLOCK right keypoints,
+// so the descriptors of a tile stay in cache while all of its pairs are compared.
+// A task takes a group of MATCHING_BLOCK left keypoints and walks through the right blocks in order:
+// the left bests of the group are final, the right bests are local to the group and reduced afterwards
+// in the order of the groups. With strict < everywhere every best is the first minimum like in a serial scan.
+// Pairs that cannot beat the current left or right best are rejected by a lower bound from coarse cell sums,
+// or their sum stops early, neither changes any best.
+#define MATCHING_BLOCK 64
+
+// all pairs of the left keypoint groups [range.start,range.end), with a guide only the pairs near the prediction
+class MatchPairsBody : public cv::ParallelLoopBody {
+public:
+	MatchPairsBody(const DESCRIPTORS *descl, const DESCRIPTORS *descr, double *ql, int *pl, double *qr, int *pr,
+		const vector<KEYPOINT> &pointsl, const vector<KEYPOINT> &pointsr, const GUIDE *guide, const KEYPOINT_GRID *grid)
+		: descl(descl), descr(descr), ql(ql), pl(pl), qr(qr), pr(pr), pointsl(pointsl), pointsr(pointsr), guide(guide), grid(grid) {}
+
+	void operator()(const cv::Range &range) const {
+		const int nl = descl->count;
+		const int nr = descr->count;
+		vector<int> candidates;
+
+		for (int g = range.start; g < range.end; g++) {
+			int l0 = g*MATCHING_BLOCK;
+			int l1 = l0 + MATCHING_BLOCK < nl ? l0 + MATCHING_BLOCK : nl;
+			double *gq = qr + (size_t)g*nr;
+			int *gp = pr + (size_t)g*nr;
+
+			for (int ir = 0; ir < nr; ir++) {
+				gq[ir] = numeric_limits<double>::max();
+				gp[ir] = -1;
+			}
+			for (int il = l0; il < l1; il++) {
+				ql[il] = numeric_limits<double>::max();
+				pl[il] = -1;
+			}
+
+			if (guide) {
+				for (int il = l0; il < l1; il++) {
+					double x, y;
+					if (!descl->valid[il] || !guide_predict(guide, pointsl[il].x, pointsl[il].y, &x, &y)) continue;
+					query_keypoint_grid(grid, pointsr, x, y, guide->radius, candidates);
+					for (size_t k = 0; k < candidates.size(); k++) compare(il, candidates[k], gq, gp);
+				}
+				continue;
+			}
+
+			for (int r0 = 0; r0 < nr; r0 += MATCHING_BLOCK) {
+				int r1 = r0 + MATCHING_BLOCK < nr ? r0 + MATCHING_BLOCK : nr;
+				for (int il = l0; il < l1; il++) {
+					for (int ir = r0; ir < r1; ir++) compare(il, ir, gq, gp);
+				}
+			}
 		}
 	}
-	return q;
-}
+
+private:
+	void compare(int il, int ir, double *gq, int *gp) const {
+		// points that are close to borders never match
+		if (!descl->valid[il] || !descr->valid[ir]) return;
+		double q;
+		if (descl->mode == DESCRIPTOR_BRIEF) {
+			q = descriptor_hamming(descriptor(descl, il), descriptor(descr, ir));
+		}
+		else if (descl->mode == DESCRIPTOR_PCA) {
+			q = descriptor_l2(descriptor(descl, il), descriptor(descr, ir), descl->stride);
+		}
+		else if (descl->mode == DESCRIPTOR_NCC) {
+			q = descriptor_ncc(descl, il, descr, ir);
+		}
+		else {
+			// a pair at or above both bests changes nothing: skip it on the coarse bound,
+			// or stop its sum as soon as it gets there
+			double bound = max(ql[il], gq[ir]);
+			if (descriptor_bound(descl, il, descr, ir) >= bound) return;
+			unsigned int limit = bound < UINT_MAX ? (unsigned int)bound : UINT_MAX;
+			q = descriptor_ssd_bounded(descriptor(descl, il), descriptor(descr, ir), descl->stride, limit);
+		}
+		if (q < ql[il]) {
+			ql[il] = q;
+			pl[il] = ir;
+		}
+		if (q < gq[ir]) {
+			gq[ir] = q;
+			gp[ir] = il;
+		}
+	}
+
+	const DESCRIPTORS *descl;
+	const DESCRIPTORS *descr;
+	double *ql;
+	int *pl;
+	double *qr; // one row of nr per group
+	int *pr;
+	const vector<KEYPOINT> &pointsl;
+	const vector<KEYPOINT> &pointsr;
+	const GUIDE *guide;
+	const KEYPOINT_GRID *grid;
+};
+
+// right bests of the keypoints [range.start,range.end) over all groups, row 0 of qr and pr gets the result
+class MatchReduceBody : public cv::ParallelLoopBody {
+public:
+	MatchReduceBody(int groups, int nr, double *qr, int *pr) : groups(groups), nr(nr), qr(qr), pr(pr) {}
+
+	void operator()(const cv::Range &range) const {
+		for (int ir = range.start; ir < range.end; ir++) {
+			for (int g = 1; g < groups; g++) {
+				if (qr[(size_t)g*nr + ir] < qr[ir]) {
+					qr[ir] = qr[(size_t)g*nr + ir];
+					pr[ir] = pr[(size_t)g*nr + ir];
+				}
+			}
+		}
+	}
+
+private:
+	int groups;
+	int nr;
+	double *qr;
+	int *pr;
+};
+
+// drops the bests of [range.start,range.end) whose partner has another best
+class CrossCheckBody : public cv::ParallelLoopBody {
+public:
+	CrossCheckBody(int *p, const int *other) : p(p), other(other) {}
+
+	void operator()(const cv::Range &range) const {
+		for (int i = range.start; i < range.end; i++) {
+			if (p[i] != -1) {
+				if (other[p[i]] != i) p[i] = -1;
+			}
+		}
+	}
+
+private:
+	int *p;
+	const int *other;
+};
 
 vector<MATCH> matching(
 	int heightl, int widthl, unsigned char *imgl,
 	int heightr, int widthr, unsigned char *imgr,
-	vector<KEYPOINT> pointsl, vector<KEYPOINT> pointsr, int wsize
+	vector<KEYPOINT> pointsl, vector<KEYPOINT> pointsr, int wsize,
+	const GUIDE *guide, DESCRIPTOR_MODE mode
 ) {
 	int nl = pointsl.size();
 	int nr = pointsr.size();
+	int groups = (nl + MATCHING_BLOCK - 1) / MATCHING_BLOCK;
+	DESCRIPTORS descl, descr;
+	extract_descriptor_pair(heightl, widthl, imgl, heightr, widthr, imgr, pointsl, pointsr, wsize, mode, &descl, &descr);
 	double *ql = new double[nl];
-	double *qr = new double[nr];
+	double *qr = new double[(size_t)(groups > 0 ? groups : 1)*nr];
 	int *pl = new int[nl];
-	int *pr = new int[nr];
+	int *pr = new int[(size_t)(groups > 0 ? groups : 1)*nr];
 
-	for (int i = 0; i < nl; i++) {
-		ql[i] = numeric_limits<double>::max();
-		pl[i] = -1;
-	}
-	for (int i = 0; i < nr; i++) {
-		qr[i] = numeric_limits<double>::max();
-		pr[i] = -1;
-	}
+	KEYPOINT_GRID grid;
+	if (guide) build_keypoint_grid(pointsr, guide->radius, &grid);
 
-	for (int il = 0; il < nl; il++) {
-		for (int ir = 0; ir < nr; ir++) {
-			int yl = (int)(pointsl[il].y + 0.5);
-			int xl = (int)(pointsl[il].x + 0.5);
-			int yr = (int)(pointsr[ir].y + 0.5);
-			int xr = (int)(pointsr[ir].x + 0.5);
-			double q = quality(heightl, widthl, imgl, yl, xl, heightr, widthr, imgr, yr, xr, wsize);
-			if (q < ql[il]) {
-				ql[il] = q;
-				pl[il] = ir;
-			}
-			if (q < qr[ir]) {
-				qr[ir] = q;
-				pr[ir] = il;
-			}
-		}
+	cv::parallel_for_(cv::Range(0, groups), MatchPairsBody(&descl, &descr, ql, pl, qr, pr, pointsl, pointsr, guide, &grid));
+	if (groups > 1) cv::parallel_for_(cv::Range(0, nr), MatchReduceBody(groups, nr, qr, pr));
+	if (groups == 0) {
+		for (int i = 0; i < nr; i++) pr[i] = -1;
 	}
 
-	// cross-check
-	for (int il = 0; il < nl; il++) {
-		if (pl[il] != -1) {
-			if (pr[pl[il]] != il) pl[il] = -1;
-		}
-	}
-	for (int ir = 0; ir < nr; ir++) {
-		if (pr[ir] != -1) {
-			if (pl[pr[ir]] != ir) pr[ir] = -1;
-		}
-	}
+	// cross-check, the right side sees the left bests that are already checked
+	cv::parallel_for_(cv::Range(0, nl), CrossCheckBody(pl, pr));
+	cv::parallel_for_(cv::Range(0, nr), CrossCheckBody(pr, pl));
+
+	free_descriptors(&descl);
+	free_descriptors(&descr);
 
 	// fill
 	vector<MATCH> ret;
@@ -97,5 +191,10 @@ vector<MATCH> matching(
 		}
 	}
 
+	delete[] ql;
+	delete[] qr;
+	delete[] pl;
+	delete[] pr;
+
 	return ret;
 }
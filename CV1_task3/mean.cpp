@@ -3,38 +3,134 @@
 using namespace std;
 #include "ps.h"
 
-void mean_filter(int height, int width, double *a, int wsize) {
-    double *tmp=new double[height*width];
-
-    // horizontal
-    for( int i=0; i<height; i++ ) {
-        // integrate
-        double *row=new double[width];
-        row[0]=a[i*width];
-        for( int j=1; j<width; j++ ) row[j]=row[j-1]+a[i*width+j];
-        // left border
-        for( int j=0; j<wsize+1; j++ ) tmp[i*width+j]=row[j+wsize]/(j+wsize+1.);
-        // inside
-        for( int j=wsize+1; j<width-wsize; j++ ) tmp[i*width+j]=(row[j+wsize]-row[j-wsize-1])/(2.*wsize+1.);
-        // right border
-        for( int j=width-wsize; j<width; j++ ) tmp[i*width+j]=(row[width-1]-row[j-wsize-1])/(width-j+wsize);
-        delete[] row;
+// Box filter with prefix sums, every output divides by the number of pixels of the window inside the image:
+// hi=min(n-1,i+wsize), lo=max(0,i-wsize) -> (sum[hi]-sum[lo-1])/(hi-lo+1)
+// The prefix sums are built in place and summed in the same order as a plain running sum,
+// so the result does not depend on the number of threads.
+
+// columns of one strip of the vertical pass, two doubles per SSE2 register
+#define MEAN_STRIP 256
+
+// horizontal pass of rows [range.start,range.end): prefix sums in place in a, means into tmp
+class MeanRowsBody : public cv::ParallelLoopBody {
+public:
+    MeanRowsBody(int width, double *a, double *tmp, int wsize) : width(width), a(a), tmp(tmp), wsize(wsize) {}
+
+    void operator()(const cv::Range &range) const {
+        for( int i=range.start; i<range.end; i++ ) {
+            double *row=a+(size_t)i*width;
+            double *out=tmp+(size_t)i*width;
+            // integrate
+            for( int j=1; j<width; j++ ) row[j]+=row[j-1];
+            // borders and inside
+            for( int j=0; j<width; j++ ) {
+                int hi=j+wsize<width-1 ? j+wsize : width-1;
+                int lo=j-wsize>0 ? j-wsize : 0;
+                if( lo>0 && hi<width-1 ) {
+                    j=inside(row,out,j,width-1-wsize)-1;
+                    continue;
+                }
+                out[j]=(lo>0 ? row[hi]-row[lo-1] : row[hi])/(hi-lo+1.);
+            }
+        }
+    }
+
+private:
+    // (row[j+wsize]-row[j-wsize-1])/(2*wsize+1) for j in [j0,j1), returns j1
+    int inside(const double *row, double *out, int j0, int j1) const {
+        const double n=2.*wsize+1.;
+        int j=j0;
+#ifdef PS_SSE2
+        const __m128d vn=_mm_set1_pd(n);
+        for( ; j+2<=j1; j+=2 )
+            _mm_storeu_pd(out+j,_mm_div_pd(_mm_sub_pd(_mm_loadu_pd(row+j+wsize),_mm_loadu_pd(row+j-wsize-1)),vn));
+#endif
+        for( ; j<j1; j++ ) out[j]=(row[j+wsize]-row[j-wsize-1])/n;
+        return j1;
+    }
+
+    int width;
+    double *a;
+    double *tmp;
+    int wsize;
+};
+
+// vertical pass of the column strips [range.start,range.end): walks down the rows,
+// turns tmp into column prefix sums in place and writes every mean row as soon as its window is summed
+class MeanColsBody : public cv::ParallelLoopBody {
+public:
+    MeanColsBody(int height, int width, double *a, double *tmp, int wsize) : height(height), width(width), a(a), tmp(tmp), wsize(wsize) {}
+
+    void operator()(const cv::Range &range) const {
+        for( int s=range.start; s<range.end; s++ ) {
+            int j0=s*MEAN_STRIP;
+            int j1=j0+MEAN_STRIP<width ? j0+MEAN_STRIP : width;
+            for( int r=0; r<height; r++ ) {
+                // integrate
+                if( r>0 ) add(tmp+(size_t)r*width,tmp+(size_t)(r-1)*width,j0,j1);
+                // the window of row r-wsize is complete
+                if( r>=wsize ) mean(r-wsize,j0,j1);
+            }
+            // bottom border, the windows end at the last row
+            for( int i=height-wsize>0 ? height-wsize : 0; i<height; i++ ) mean(i,j0,j1);
+        }
     }
 
-    // vertical
-    for( int j=0; j<width; j++ ) {
-        // integrate
-        double *col=new double[height];
-        col[0]=tmp[j];
-        for( int i=1; i<height; i++ ) col[i]=col[i-1]+tmp[i*width+j];
-        // top border
-        for( int i=0; i<wsize+1; i++ ) a[i*width+j]=col[i+wsize]/(i+wsize+1.);
-        // inside
-        for( int i=wsize+1; i<height-wsize; i++ ) a[i*width+j]=(col[i+wsize]-col[i-wsize-1])/(2.*wsize+1.);
-        // bottom border
-        for( int i=height-wsize; i<height; i++ ) a[i*width+j]=(col[height-1]-col[i-wsize-1])/(height-i+wsize);
-        delete[] col;
+private:
+    // dst+=src
+    static void add(double *dst, const double *src, int j0, int j1) {
+        int j=j0;
+#ifdef PS_SSE2
+        for( ; j+2<=j1; j+=2 ) _mm_storeu_pd(dst+j,_mm_add_pd(_mm_loadu_pd(dst+j),_mm_loadu_pd(src+j)));
+#endif
+        for( ; j<j1; j++ ) dst[j]+=src[j];
     }
 
-    delete[] tmp;
+    // row i of the result
+    void mean(int i, int j0, int j1) const {
+        int hi=i+wsize<height-1 ? i+wsize : height-1;
+        int lo=i-wsize>0 ? i-wsize : 0;
+        const double n=hi-lo+1.;
+        const double *top=tmp+(size_t)hi*width;
+        double *out=a+(size_t)i*width;
+        int j=j0;
+        if( lo>0 ) {
+            const double *bottom=tmp+(size_t)(lo-1)*width;
+#ifdef PS_SSE2
+            const __m128d vn=_mm_set1_pd(n);
+            for( ; j+2<=j1; j+=2 )
+                _mm_storeu_pd(out+j,_mm_div_pd(_mm_sub_pd(_mm_loadu_pd(top+j),_mm_loadu_pd(bottom+j)),vn));
+#endif
+            for( ; j<j1; j++ ) out[j]=(top[j]-bottom[j])/n;
+        }
+        else {
+            for( ; j<j1; j++ ) out[j]=top[j]/n;
+        }
+    }
+
+    int height;
+    int width;
+    double *a;
+    double *tmp;
+    int wsize;
+};
+
+size_t mean_filter_workspace(int height, int width) {
+    return ARENA_SIZE(double,height*width);
+}
+
+void mean_filter(int height, int width, double *a, int wsize, ARENA *arena) {
+    ARENA local=ARENA();
+    arena=arena_or_local(arena,&local,mean_filter_workspace(height,width));
+    size_t mark=arena_mark(arena);
+    double *tmp=ARENA_ALLOC(arena,double,height*width);
+
+    // horizontal, split by row bands
+    cv::parallel_for_(cv::Range(0,height),MeanRowsBody(width,a,tmp,wsize));
+
+    // vertical, split by column strips so every column keeps its order of summation
+    cv::parallel_for_(cv::Range(0,(width+MEAN_STRIP-1)/MEAN_STRIP),MeanColsBody(height,width,a,tmp,wsize));
+
+    arena_release(arena,mark);
+    arena_free(&local);
 }
@@ -0,0 +1,136 @@
+// PCA descriptors: the patches projected onto the first components of a basis learned from the image pair
+// (or read from a file), stored as floats and compared by their squared distance
+#include <string.h>
+#include "ps.h"
+
+// patches projected at once, a float copy of them is made for the projection
+#define PCA_CHUNK 256
+
+// valid patches of the descriptors a and b, about samples of them evenly spread
+static cv::Mat pca_samples(const DESCRIPTORS *a, const DESCRIPTORS *b, int samples) {
+	const DESCRIPTORS *desc[2] = { a, b };
+	std::vector<int> valid[2];
+	for (int s = 0; s < 2; s++) {
+		for (int k = 0; k < desc[s]->count; k++) {
+			if (desc[s]->valid[k]) valid[s].push_back(k);
+		}
+	}
+	size_t total = valid[0].size() + valid[1].size();
+	cv::Mat ret;
+	if (total == 0) return ret;
+
+	size_t step = total > (size_t)samples ? total / samples : 1;
+	for (int s = 0; s < 2; s++) {
+		for (size_t k = 0; k < valid[s].size(); k += step) {
+			cv::Mat row(1, a->length, CV_32F);
+			const unsigned char *patch = descriptor(desc[s], valid[s][k]);
+			for (int d = 0; d < a->length; d++) row.at<float>(0, d) = patch[d];
+			ret.push_back(row);
+		}
+	}
+	return ret;
+}
+
+void learn_descriptor_pca(const DESCRIPTORS *descl, const DESCRIPTORS *descr, int components, cv::PCA &pca) {
+	cv::Mat samples = pca_samples(descl, descr, PCA_SAMPLES);
+	if (samples.rows == 0) {
+		pca = cv::PCA();
+		return;
+	}
+	pca(samples, cv::Mat(), cv::PCA::DATA_AS_ROW, components);
+}
+
+bool load_descriptor_pca(const char *name, int length, int components, cv::PCA &pca) {
+	cv::FileStorage fs(name, cv::FileStorage::READ);
+	if (!fs.isOpened()) return false;
+	pca.read(fs.root());
+	fs.release();
+	if (pca.eigenvectors.cols != length || pca.eigenvectors.rows < components || pca.mean.cols != length) return false;
+	pca.eigenvectors = pca.eigenvectors.rowRange(0, components).clone();
+	pca.eigenvalues = pca.eigenvalues.rowRange(0, components).clone();
+	return true;
+}
+
+bool save_descriptor_pca(const char *name, const cv::PCA &pca) {
+	cv::FileStorage fs(name, cv::FileStorage::WRITE);
+	if (!fs.isOpened()) return false;
+	pca.write(fs);
+	fs.release();
+	return true;
+}
+
+// projects the patches [range.start*PCA_CHUNK,range.end*PCA_CHUNK)
+class ProjectBody : public cv::ParallelLoopBody {
+public:
+	ProjectBody(const DESCRIPTORS *patches, const cv::PCA &pca, DESCRIPTORS *desc) : patches(patches), pca(pca), desc(desc) {}
+
+	void operator()(const cv::Range &range) const {
+		cv::Mat chunk(PCA_CHUNK, patches->length, CV_32F), projected;
+		for (int c = range.start; c < range.end; c++) {
+			int k0 = c*PCA_CHUNK;
+			int k1 = k0 + PCA_CHUNK < patches->count ? k0 + PCA_CHUNK : patches->count;
+			for (int k = k0; k < k1; k++) {
+				const unsigned char *patch = descriptor(patches, k);
+				float *row = chunk.ptr<float>(k - k0);
+				for (int d = 0; d < patches->length; d++) row[d] = patch[d];
+			}
+			pca.project(chunk.rowRange(0, k1 - k0), projected);
+			for (int k = k0; k < k1; k++) {
+				// invalid patches keep zeros, they are never compared anyway
+				float *out = (float *)(desc->data + (size_t)k*desc->stride);
+				memset(out, 0, desc->stride);
+				if (!desc->valid[k]) continue;
+				for (int d = 0; d < projected.cols; d++) out[d] = projected.at<float>(k - k0, d);
+			}
+		}
+	}
+
+private:
+	const DESCRIPTORS *patches;
+	const cv::PCA &pca;
+	DESCRIPTORS *desc;
+};
+
+void project_descriptors(const DESCRIPTORS *patches, const cv::PCA &pca, DESCRIPTORS *desc) {
+	int components = pca.eigenvectors.rows;
+	desc->mode = DESCRIPTOR_PCA;
+	desc->count = patches->count;
+	desc->wsize = patches->wsize;
+	desc->length = components * (int)sizeof(float);
+	desc->stride = (desc->length + 15) / 16 * 16;
+	desc->data = (unsigned char *)cv::fastMalloc((size_t)desc->count*desc->stride + 1);
+	desc->valid = (unsigned char *)cv::fastMalloc((size_t)desc->count + 1);
+	memcpy(desc->valid, patches->valid, desc->count);
+	desc->cells = 0;
+	desc->coarse = (double *)cv::fastMalloc(sizeof(double));
+	desc->sums = desc->norms = NULL;
+
+	if (components == 0) {
+		// nothing to learn from: no patch is valid
+		memset(desc->data, 0, (size_t)desc->count*desc->stride);
+		return;
+	}
+	cv::parallel_for_(cv::Range(0, (desc->count + PCA_CHUNK - 1) / PCA_CHUNK), ProjectBody(patches, pca, desc));
+}
+
+void extract_pca_descriptors(
+	int heightl, int widthl, const unsigned char *imgl,
+	int heightr, int widthr, const unsigned char *imgr,
+	const std::vector<KEYPOINT> &pointsl, const std::vector<KEYPOINT> &pointsr, int wsize,
+	int components, const char *basis, DESCRIPTORS *descl, DESCRIPTORS *descr
+) {
+	DESCRIPTORS patchl, patchr;
+	extract_descriptors(heightl, widthl, imgl, pointsl, wsize, &patchl);
+	extract_descriptors(heightr, widthr, imgr, pointsr, wsize, &patchr);
+
+	cv::PCA pca;
+	if (basis == NULL || !load_descriptor_pca(basis, patchl.length, components, pca)) {
+		learn_descriptor_pca(&patchl, &patchr, components, pca);
+		if (basis != NULL && !pca.eigenvectors.empty()) save_descriptor_pca(basis, pca);
+	}
+
+	project_descriptors(&patchl, pca, descl);
+	project_descriptors(&patchr, pca, descr);
+	free_descriptors(&patchl);
+	free_descriptors(&patchr);
+}
@@ -0,0 +1,115 @@
+// raw planes: the exact values of an intermediate result, written and read through memory mappings
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ps.h"
+
+// maps the whole file, writable files are created (or truncated) with the given size
+static void *map_file(const char *name, size_t *size, bool write, PLANE *plane) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(name, write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+		write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+	if (!write) {
+		LARGE_INTEGER len;
+		if (!GetFileSizeEx(file, &len)) { CloseHandle(file); return NULL; }
+		*size = (size_t)len.QuadPart;
+	}
+	if (*size == 0) { CloseHandle(file); return NULL; }
+	HANDLE mapping = CreateFileMappingA(file, NULL, write ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)((unsigned long long)*size >> 32), (DWORD)(*size & 0xffffffffu), NULL);
+	if (mapping == NULL) { CloseHandle(file); return NULL; }
+	void *base = MapViewOfFile(mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, *size);
+	if (base == NULL) { CloseHandle(mapping); CloseHandle(file); return NULL; }
+	plane->file = file;
+	plane->mapping = mapping;
+	return base;
+#else
+	(void)plane; // the mapping needs no handles here
+	int fd = write ? open(name, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(name, O_RDONLY);
+	if (fd < 0) return NULL;
+	if (write) {
+		if (ftruncate(fd, (off_t)*size) != 0) { close(fd); return NULL; }
+	}
+	else {
+		struct stat st;
+		if (fstat(fd, &st) != 0) { close(fd); return NULL; }
+		*size = (size_t)st.st_size;
+	}
+	if (*size == 0) { close(fd); return NULL; }
+	void *base = mmap(NULL, *size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the file open
+	return base == MAP_FAILED ? NULL : base;
+#endif
+}
+
+void unmap_plane(PLANE *plane) {
+	if (plane->base == NULL) return;
+#ifdef _WIN32
+	UnmapViewOfFile(plane->base);
+	CloseHandle((HANDLE)plane->mapping);
+	CloseHandle((HANDLE)plane->file);
+	plane->file = plane->mapping = NULL;
+#else
+	munmap(plane->base, plane->size);
+#endif
+	plane->base = NULL;
+	plane->data = NULL;
+	plane->size = 0;
+}
+
+bool save_plane(int height, int width, int type, const void *data, const char *name) {
+	PLANE plane;
+	memset(&plane, 0, sizeof(plane));
+
+	size_t bytes = (size_t)height*width*CV_ELEM_SIZE(type);
+	plane.size = sizeof(PLANE_HEADER) + bytes;
+	plane.base = map_file(name, &plane.size, true, &plane);
+	if (plane.base == NULL) return false;
+
+	PLANE_HEADER header;
+	memcpy(header.magic, PLANE_MAGIC, 4);
+	header.height = height;
+	header.width = width;
+	header.type = type;
+	memcpy(plane.base, &header, sizeof(header));
+	memcpy((char *)plane.base + sizeof(header), data, bytes);
+
+	unmap_plane(&plane);
+	return true;
+}
+
+bool save_double_as_plane(int height, int width, double *array, const char *name) {
+	return save_plane(height, width, CV_64FC1, array, name);
+}
+
+bool map_plane(const char *name, PLANE *plane) {
+	memset(plane, 0, sizeof(*plane));
+	plane->base = map_file(name, &plane->size, false, plane);
+	if (plane->base == NULL) return false;
+
+	PLANE_HEADER header;
+	if (plane->size >= sizeof(header)) memcpy(&header, plane->base, sizeof(header));
+	if (plane->size < sizeof(header) || memcmp(header.magic, PLANE_MAGIC, 4) != 0 || header.height < 0 || header.width < 0
+		|| (header.type != CV_32FC1 && header.type != CV_64FC1)
+		|| plane->size != sizeof(header) + (size_t)header.height*header.width*CV_ELEM_SIZE(header.type)) {
+		unmap_plane(plane);
+		return false;
+	}
+
+	plane->height = header.height;
+	plane->width = header.width;
+	plane->type = header.type;
+	plane->data = (char *)plane->base + sizeof(header);
+	return true;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <vector>
 
 #include <opencv2/core/core.hpp>
@@ -12,8 +14,40 @@
 // save all intermediate results as images
 #define SAVE_ALL
 
+// save the intermediate results of harris() as raw planes with their exact values
+//#define SAVE_RAW
+
+// match only keypoints near the position predicted by a first pass, see estimate_guide()
+//#define GUIDED_MATCHING
+
+// match with approximate nearest neighbours, for images with very many keypoints
+//#define ANN_MATCHING
+
+// descriptors of the matching in main: DESCRIPTOR_PATCH, DESCRIPTOR_BRIEF, DESCRIPTOR_PCA or DESCRIPTOR_NCC
+#define MATCHING_DESCRIPTOR DESCRIPTOR_PATCH
+
+// one-to-one assignment of the Matching in main: ASSIGNMENT_GREEDY or ASSIGNMENT_AUCTION
+#define MATCHING_ASSIGNMENT ASSIGNMENT_GREEDY
+
+// final epsilon of the auction: its total cost ends within keypoints*epsilon of the optimum,
+// 0 takes 1/(keypoints+1) which gives the optimum for integer costs (patch and BRIEF descriptors)
+#define AUCTION_EPSILON 0.
+
+// candidates of every keypoint kept by the Matching in main: the k pairs of lowest cost of every left
+// and of every right keypoint, so its tables grow linearly with the keypoints; 0 keeps all pairs
+#define MATCHING_CANDIDATES 0
+
 #define INDEX(i,j,c) ((((i)*width)+(j))*3+(c))
 
+// SSE2 kernels, all of them have a scalar fallback
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PS_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
 typedef struct {
 	double x;
 	double y;
@@ -28,23 +62,458 @@ typedef struct {
 	double value;
 } MATCH;
 
+// bump allocator for the scratch buffers of harris(), mean_filter() and local_maxima()
+// the first call reserves it (or reserve it for the largest image), then no call allocates anything
+typedef struct {
+	char *base;
+	size_t size;
+	size_t used;
+} ARENA;
+
+#define ARENA_ALIGN 64
+
+// bytes n elements of the type take from the arena at most (alignment included)
+#define ARENA_SIZE(type, n) ((size_t)(n)*sizeof(type) + ARENA_ALIGN)
+
+#define ARENA_ALLOC(arena, type, n) ((type *)arena_alloc((arena), (size_t)(n)*sizeof(type)))
+
+// grows the arena to at least size bytes, only while nothing is allocated from it
+inline void arena_reserve(ARENA *arena, size_t size) {
+	if (size <= arena->size) return;
+	CV_Assert(arena->used == 0);
+	free(arena->base);
+	arena->base = (char *)malloc(size);
+	if (arena->base == NULL) CV_Error(cv::Error::StsNoMem, "arena_reserve");
+	arena->size = size;
+}
+
+inline void arena_free(ARENA *arena) {
+	free(arena->base);
+	arena->base = NULL;
+	arena->size = arena->used = 0;
+}
+
+inline void *arena_alloc(ARENA *arena, size_t bytes) {
+	uintptr_t p = ((uintptr_t)(arena->base + arena->used) + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+	size_t used = (size_t)(p - (uintptr_t)arena->base) + bytes;
+	CV_Assert(used <= arena->size);
+	arena->used = used;
+	return (void *)p;
+}
+
+// everything allocated after the mark is given back by arena_release
+inline size_t arena_mark(ARENA *arena) {
+	return arena->used;
+}
+
+inline void arena_release(ARENA *arena, size_t mark) {
+	arena->used = mark;
+}
+
+// the arena if there is one, else local -- free local with arena_free
+// an arena nothing is allocated from yet grows to size bytes, so the first call with it is the warm-up
+inline ARENA *arena_or_local(ARENA *arena, ARENA *local, size_t size) {
+	if (arena == NULL) arena = local;
+	if (arena->used == 0) arena_reserve(arena, size);
+	return arena;
+}
+
 std::vector<KEYPOINT> harris(
 	int height, int width, unsigned char *img,
-	int wsize_sum, int wsize_loc, const char *name
+	int wsize_sum, int wsize_loc, const char *name, ARENA *arena = NULL
+);
+
+size_t harris_workspace(int height, int width, int wsize_loc);
+
+// DESCRIPTOR_PATCH: the raw window compared by SSD, the accurate one
+// DESCRIPTOR_BRIEF: BRIEF_BITS intensity comparisons in the smoothed window compared by Hamming distance, the fast one
+// DESCRIPTOR_PCA: the window projected onto PCA_COMPONENTS principal components as floats, compared by squared distance
+// DESCRIPTOR_NCC: the raw window compared by 1 - normalized cross-correlation, robust to exposure changes
+typedef enum {
+	DESCRIPTOR_PATCH,
+	DESCRIPTOR_BRIEF,
+	DESCRIPTOR_PCA,
+	DESCRIPTOR_NCC
+} DESCRIPTOR_MODE;
+
+#define BRIEF_BITS 256
+
+// components of the PCA descriptors and patches of the image pair the basis is learned from
+#define PCA_COMPONENTS 48
+#define PCA_SAMPLES 1024
+
+// basis of the PCA descriptors: NULL learns it from every image pair, a file name reads it from there,
+// or learns it and writes it there if the file does not hold a basis for the window size
+#define PCA_BASIS NULL
+
+// the descriptors of keypoints, extracted once for matching -- for DESCRIPTOR_PATCH and DESCRIPTOR_NCC (2*wsize+1)^2 BGR pixels
+// row after row, zero padded to a multiple of 16 bytes, so two patches can be compared with aligned SSE2 loads;
+// for DESCRIPTOR_BRIEF BRIEF_BITS/64 words of bits, for DESCRIPTOR_PCA floats padded the same way
+typedef struct {
+	DESCRIPTOR_MODE mode;
+	int count;
+	int wsize;
+	int length; // bytes of a patch
+	int stride; // bytes of a patch with padding
+	unsigned char *data; // cv::fastMalloc, 16 byte aligned
+	unsigned char *valid; // 0 for keypoints whose patch crosses the image border
+	int cells; // coarse cells of a patch: a grid of cells per channel, none for the other modes
+	double *coarse; // cells values per patch: channel sum of the cell / sqrt(pixels of the cell)
+	double *sums; // DESCRIPTOR_NCC: sum of the patch bytes
+	double *norms; // DESCRIPTOR_NCC: 1/sqrt(sum of squares - sum^2/length), 0 for a flat patch
+} DESCRIPTORS;
+
+// pixels on a side of a coarse cell (at least), and most cells on a side of the grid
+#define DESCRIPTOR_CELL 5
+#define DESCRIPTOR_GRID 4
+
+// bytes of a patch summed up between two checks of the bound of descriptor_ssd_bounded()
+#define DESCRIPTOR_CHUNK 64
+
+void extract_descriptors(
+	int height, int width, const unsigned char *img,
+	const std::vector<KEYPOINT> &points, int wsize, DESCRIPTORS *desc,
+	DESCRIPTOR_MODE mode = DESCRIPTOR_PATCH
+);
+
+// the descriptors of both images in any mode, the PCA basis is shared by both
+void extract_descriptor_pair(
+	int heightl, int widthl, const unsigned char *imgl,
+	int heightr, int widthr, const unsigned char *imgr,
+	const std::vector<KEYPOINT> &pointsl, const std::vector<KEYPOINT> &pointsr, int wsize,
+	DESCRIPTOR_MODE mode, DESCRIPTORS *descl, DESCRIPTORS *descr
+);
+
+void learn_descriptor_pca(const DESCRIPTORS *descl, const DESCRIPTORS *descr, int components, cv::PCA &pca);
+
+bool load_descriptor_pca(const char *name, int length, int components, cv::PCA &pca);
+
+bool save_descriptor_pca(const char *name, const cv::PCA &pca);
+
+// DESCRIPTOR_PCA descriptors from DESCRIPTOR_PATCH ones
+void project_descriptors(const DESCRIPTORS *patches, const cv::PCA &pca, DESCRIPTORS *desc);
+
+void extract_pca_descriptors(
+	int heightl, int widthl, const unsigned char *imgl,
+	int heightr, int widthr, const unsigned char *imgr,
+	const std::vector<KEYPOINT> &pointsl, const std::vector<KEYPOINT> &pointsr, int wsize,
+	int components, const char *basis, DESCRIPTORS *descl, DESCRIPTORS *descr
+);
+
+void free_descriptors(DESCRIPTORS *desc);
+
+inline const unsigned char *descriptor(const DESCRIPTORS *desc, int k) {
+	return desc->data + (size_t)k*desc->stride;
+}
+
+// sum of squared differences of the bytes [k0,k1) of two patches, k0 and k1 multiples of 16
+inline unsigned int descriptor_ssd_range(const unsigned char *a, const unsigned char *b, int k0, int k1) {
+	unsigned int ret = 0;
+	int k = k0;
+#ifdef PS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for (; k < k1; k += 16) {
+		__m128i va = _mm_load_si128((const __m128i *)(a + k));
+		__m128i vb = _mm_load_si128((const __m128i *)(b + k));
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+		acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	ret = (unsigned int)_mm_cvtsi128_si32(acc);
+#endif
+	for (; k < k1; k++) {
+		int d = a[k] - b[k];
+		ret += d*d;
+	}
+	return ret;
+}
+
+// sum of squared differences of two patches, exact for wsize <= 57
+inline unsigned int descriptor_ssd(const unsigned char *a, const unsigned char *b, int stride) {
+	return descriptor_ssd_range(a, b, 0, stride);
+}
+
+// descriptor_ssd() that stops as soon as the sum reaches bound, the result is then >= bound but not the full sum
+inline unsigned int descriptor_ssd_bounded(const unsigned char *a, const unsigned char *b, int stride, unsigned int bound) {
+	unsigned int ret = 0;
+	for (int k = 0; k < stride && ret < bound; k += DESCRIPTOR_CHUNK) {
+		ret += descriptor_ssd_range(a, b, k, k + DESCRIPTOR_CHUNK < stride ? k + DESCRIPTOR_CHUNK : stride);
+	}
+	return ret;
+}
+
+// lower bound of descriptor_ssd() from the coarse cells: sum((a-b)^2) >= (sum(a)-sum(b))^2/n on every cell;
+// its rounding error stays far below 1, so it never rejects a pair whose integer sum is below an integer bound
+inline double descriptor_bound(const DESCRIPTORS *descl, int il, const DESCRIPTORS *descr, int ir) {
+	const double *cl = descl->coarse + (size_t)il*descl->cells;
+	const double *cr = descr->coarse + (size_t)ir*descr->cells;
+	double ret = 0.;
+	int c = 0;
+#ifdef PS_SSE2
+	__m128d acc = _mm_setzero_pd();
+	for (; c + 2 <= descl->cells; c += 2) {
+		__m128d d = _mm_sub_pd(_mm_loadu_pd(cl + c), _mm_loadu_pd(cr + c));
+		acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+	}
+	ret = _mm_cvtsd_f64(_mm_add_sd(acc, _mm_unpackhi_pd(acc, acc)));
+#endif
+	for (; c < descl->cells; c++) {
+		double d = cl[c] - cr[c];
+		ret += d*d;
+	}
+	return ret;
+}
+
+// dot product of two patches, exact for wsize <= 57
+inline unsigned int descriptor_dot(const unsigned char *a, const unsigned char *b, int stride) {
+	unsigned int ret = 0;
+	int k = 0;
+#ifdef PS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for (; k < stride; k += 16) {
+		__m128i va = _mm_load_si128((const __m128i *)(a + k));
+		__m128i vb = _mm_load_si128((const __m128i *)(b + k));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero)));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	ret = (unsigned int)_mm_cvtsi128_si32(acc);
+#endif
+	for (; k < stride; k++) ret += a[k] * b[k];
+	return ret;
+}
+
+// 1 - normalized cross-correlation of two DESCRIPTOR_NCC patches, in [0,2]; the normalization is precomputed
+inline double descriptor_ncc(const DESCRIPTORS *descl, int il, const DESCRIPTORS *descr, int ir) {
+	double dot = descriptor_dot(descriptor(descl, il), descriptor(descr, ir), descl->stride);
+	return 1. - (dot - descl->sums[il] * descr->sums[ir] / descl->length) * descl->norms[il] * descr->norms[ir];
+}
+
+// squared distance of two PCA descriptors
+inline double descriptor_l2(const unsigned char *a, const unsigned char *b, int stride) {
+	const float *fa = (const float *)a;
+	const float *fb = (const float *)b;
+	int n = stride / (int)sizeof(float);
+	float ret = 0.f;
+	int k = 0;
+#ifdef PS_SSE2
+	__m128 acc = _mm_setzero_ps();
+	for (; k < n; k += 4) {
+		__m128 d = _mm_sub_ps(_mm_load_ps(fa + k), _mm_load_ps(fb + k));
+		acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+	}
+	acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+	acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+	ret = _mm_cvtss_f32(acc);
+#endif
+	for (; k < n; k++) {
+		float d = fa[k] - fb[k];
+		ret += d*d;
+	}
+	return ret;
+}
+
+inline int popcount64_swar(uint64_t x) {
+	x = x - ((x >> 1) & 0x5555555555555555ull);
+	x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+	return (int)((x * 0x0101010101010101ull) >> 56);
+}
+
+inline int popcount64(uint64_t x) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	// __popcnt64 is the POPCNT instruction, which not every x64 CPU has
+	static const bool popcnt = cv::checkHardwareSupport(CV_CPU_POPCNT);
+	return popcnt ? (int)__popcnt64(x) : popcount64_swar(x);
+#elif defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	return popcount64_swar(x);
+#endif
+}
+
+// differing bits of two BRIEF descriptors
+inline int descriptor_hamming(const unsigned char *a, const unsigned char *b) {
+	const uint64_t *wa = (const uint64_t *)a;
+	const uint64_t *wb = (const uint64_t *)b;
+	int ret = 0;
+	for (int k = 0; k < BRIEF_BITS / 64; k++) ret += popcount64(wa[k] ^ wb[k]);
+	return ret;
+}
+
+// sum of absolute differences of two patches
+inline unsigned int descriptor_sad(const unsigned char *a, const unsigned char *b, int stride) {
+	unsigned int ret = 0;
+	int k = 0;
+#ifdef PS_SSE2
+	__m128i acc = _mm_setzero_si128();
+	for (; k < stride; k += 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_load_si128((const __m128i *)(a + k)), _mm_load_si128((const __m128i *)(b + k))));
+	}
+	ret = (unsigned int)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc)));
+#endif
+	for (; k < stride; k++) {
+		ret += a[k] > b[k] ? a[k] - b[k] : b[k] - a[k];
+	}
+	return ret;
+}
+
+// guided matching: a left keypoint is only compared with the right keypoints within radius of H*(x,y,1)
+typedef struct {
+	double H[9]; // left -> right, row major, a plain shift or a homography
+	double radius;
+} GUIDE;
+
+// first pass matches from which guide_from_matches() also tries a homography
+#define GUIDE_MIN_HOMOGRAPHY 20
+
+inline bool guide_predict(const GUIDE *guide, double x, double y, double *xp, double *yp) {
+	const double *H = guide->H;
+	double w = H[6] * x + H[7] * y + H[8];
+	if (!(w > 0.)) return false;
+	*xp = (H[0] * x + H[1] * y + H[2]) / w;
+	*yp = (H[3] * x + H[4] * y + H[5]) / w;
+	return true;
+}
+
+// keypoints bucketed into square cells, the indices of cell c are index[start[c]] ... index[start[c+1]-1]
+typedef struct {
+	double cell;
+	double x0; // corner of cell 0
+	double y0;
+	int rows;
+	int cols;
+	std::vector<int> start;
+	std::vector<int> index;
+} KEYPOINT_GRID;
+
+void build_keypoint_grid(const std::vector<KEYPOINT> &points, double cell, KEYPOINT_GRID *grid);
+
+// ascending indices of the keypoints within radius of (x,y)
+void query_keypoint_grid(
+	const KEYPOINT_GRID *grid, const std::vector<KEYPOINT> &points,
+	double x, double y, double radius, std::vector<int> &candidates
+);
+
+bool guide_from_matches(const std::vector<MATCH> &matches, double radius, GUIDE *guide);
+
+// matches a subset of about samples left keypoints with all right ones and fits the guide to the result
+bool estimate_guide(
+	int heightl, int widthl, unsigned char *imgl,
+	int heightr, int widthr, unsigned char *imgr,
+	const std::vector<KEYPOINT> &pointsl, const std::vector<KEYPOINT> &pointsr, int wsize,
+	int samples, double radius, GUIDE *guide
 );
 
 std::vector<MATCH> matching(
 	int heightl, int widthl, unsigned char *imgl,
 	int heightr, int widthr, unsigned char *imgr,
-	std::vector<KEYPOINT>pointsl, std::vector<KEYPOINT>pointsr, int wsize
+	std::vector<KEYPOINT>pointsl, std::vector<KEYPOINT>pointsr, int wsize,
+	const GUIDE *guide = NULL, DESCRIPTOR_MODE mode = DESCRIPTOR_PATCH
 );
 
-void mean_filter(int height, int width, double *a, int wsize);
+// approximate nearest neighbours: a forest of randomized k-d trees over the valid descriptors
+typedef struct {
+	int dim; // byte of the descriptor to split on, -1 for a leaf
+	double split; // smaller values go left
+	int left; // children, for a leaf the range [left,right) of the indices of its tree
+	int right;
+} ANN_NODE;
+
+typedef struct {
+	const DESCRIPTORS *desc;
+	std::vector<std::vector<ANN_NODE> > nodes; // per tree, root first
+	std::vector<std::vector<int> > indices; // per tree, descriptors ordered by leaf
+} ANN_INDEX;
+
+void build_ann_index(const DESCRIPTORS *desc, int trees, ANN_INDEX *index);
+
+// nearest descriptor of the index and its SSD for every query, -1 for invalid queries;
+// more checks (compared descriptors) are slower and closer to the exact result, 0 searches without limit:
+// the keys of the branches are lower bounds of the SSD to their cells, so the result is then exact
+void query_ann_index(const ANN_INDEX *index, const DESCRIPTORS *queries, int checks, int *nearest, double *dist);
+
+// matching() for many keypoints: cross-checked nearest neighbours from the k-d forests
+std::vector<MATCH> matching_ann(
+	int heightl, int widthl, unsigned char *imgl,
+	int heightr, int widthr, unsigned char *imgr,
+	const std::vector<KEYPOINT> &pointsl, const std::vector<KEYPOINT> &pointsr, int wsize,
+	int trees, int checks
+);
+
+// how Matching picks its pairs from the cost table: greedily by normalized cost, or the assignment
+// with the smallest total cost found by an auction
+typedef enum {
+	ASSIGNMENT_GREEDY,
+	ASSIGNMENT_AUCTION
+} ASSIGNMENT;
+
+// one-to-one assignment of the rows of cost (CV_64F) to its columns with the smallest total cost,
+// entries at or above INT_MAX are never assigned; column of every row in assigned, -1 for none
+void auction_assignment(const cv::Mat &cost, double epsilon, int *assigned);
+
+// a cost table that keeps only some of its entries, row after row with ascending columns (compressed sparse rows)
+typedef struct {
+	int rows;
+	int cols;
+	std::vector<int> start; // rows+1, the entries of row r are [start[r],start[r+1])
+	std::vector<int> index; // column of an entry
+	std::vector<double> cost;
+} SPARSE_COSTS;
+
+// auction_assignment() on the entries of a sparse table, the other pairs are never assigned
+void auction_assignment_sparse(const SPARSE_COSTS *cost, double epsilon, int *assigned);
 
-std::vector<KEYPOINT> local_maxima(int height, int width, double *e, int wsize, const char *name);
+void mean_filter(int height, int width, double *a, int wsize, ARENA *arena = NULL);
+
+size_t mean_filter_workspace(int height, int width);
+
+std::vector<KEYPOINT> local_maxima(int height, int width, double *e, int wsize, const char *name, ARENA *arena = NULL);
+
+size_t local_maxima_workspace(int height, int width, int wsize);
 
 void save_double_as_image(int height, int width, double *array, const char *name);
 
+// raw plane file: the header, followed by height*width values of the type row by row
+#define PLANE_MAGIC "PSPL"
+
+typedef struct {
+	char magic[4];
+	int32_t height;
+	int32_t width;
+	int32_t type; // CV_32FC1 or CV_64FC1
+} PLANE_HEADER;
+
+// a plane file mapped into memory, data points into the mapping -- read only
+typedef struct {
+	int height;
+	int width;
+	int type;
+	const void *data;
+	void *base;
+	size_t size;
+	void *file; // Win32 handles
+	void *mapping;
+} PLANE;
+
+bool save_plane(int height, int width, int type, const void *data, const char *name);
+
+bool save_double_as_plane(int height, int width, double *array, const char *name);
+
+bool map_plane(const char *name, PLANE *plane);
+
+void unmap_plane(PLANE *plane);
+
+// wraps the mapped plane without copying, valid until unmap_plane
+inline cv::Mat plane_as_mat(const PLANE *plane) {
+	return cv::Mat(plane->height, plane->width, plane->type, const_cast<void *>(plane->data));
+}
+
 void save_matches_as_image(
 	int heightl, int widthl, unsigned char *imgl,
 	int heightr, int widthr, unsigned char *imgr,